@@ -44,6 +44,27 @@ static unsigned int tripleclicktimeout = 600;
 /* alt screens */
 int allowaltscreen = 1;
 
+/*
+ * maximum size in bytes of an OSC, DCS, PM or APC string, such as an OSC 52
+ * clipboard payload; longer strings are dropped
+ */
+unsigned int maxstrlen = 8 * 1024 * 1024;
+
+/*
+ * rows of history kept to scroll back to, overridden by the -s option.
+ * history rows are kept packed as text and attribute runs, a few dozen
+ * bytes for a line of plain text, and only as lines scroll off the screen.
+ */
+unsigned int histsize = 2000;
+
+/*
+ * rows of history kept in memory. older rows, up to histsize, go to a
+ * temporary file in $TMPDIR or /tmp, mapped into memory for the system to page in
+ * and out, which is removed as soon as it is created. with a large
+ * histsize, this keeps as much history as the disk holds.
+ */
+unsigned int histmem = 10000;
+
 /* allow certain non-interactive (insecure) window operations such as:
    setting the clipboard text */
 int allowwindowops = 0;
@@ -57,6 +78,31 @@ int allowwindowops = 0;
 static double minlatency = 8;
 static double maxlatency = 33;
 
+/*
+ * time in ms the tty is parsed at a stretch. while a program floods the
+ * terminal, key presses wait at most this long to be handled.
+ */
+unsigned int parsebudget = 10;
+
+/*
+ * shortest time in ms between two sizes the program in the terminal is told
+ * of. while the window is resized, the sizes in between are skipped, so that
+ * it does not redraw for each of them.
+ */
+static unsigned int resizeinterval = 50;
+
+/*
+ * longest time in ms drawing is held for a synchronized update (DEC private
+ * mode 2026) which the application does not end
+ */
+static unsigned int synctimeout = 200;
+
+/*
+ * time in ms the alternate screen is kept once the application which used it
+ * leaves it. it is allocated again, blank, for the next one.
+ */
+static unsigned int alttimeout = 10000;
+
 /*
  * blinking timeout (set to 0 to disable blinking) for the terminal blinking
  * attribute.
@@ -213,9 +259,16 @@ ResourcePref resources[] = {
 		{ "shell",        STRING,  &shell },
 		{ "minlatency",   INTEGER, &minlatency },
 		{ "maxlatency",   INTEGER, &maxlatency },
+		{ "parsebudget",  INTEGER, &parsebudget },
 		{ "blinktimeout", INTEGER, &blinktimeout },
+		{ "synctimeout",  INTEGER, &synctimeout },
+		{ "resizeinterval", INTEGER, &resizeinterval },
+		{ "alttimeout",   INTEGER, &alttimeout },
 		{ "bellvolume",   INTEGER, &bellvolume },
 		{ "tabspaces",    INTEGER, &tabspaces },
+		{ "maxstrlen",    INTEGER, &maxstrlen },
+		{ "histsize",     INTEGER, &histsize },
+		{ "histmem",      INTEGER, &histmem },
 		{ "borderpx",     INTEGER, &borderpx },
 		{ "cwscale",      FLOAT,   &cwscale },
 		{ "chscale",      FLOAT,   &chscale },
@@ -260,6 +313,7 @@ static Shortcut shortcuts[] = {
 	{ MODKEY,               XK_c,           clipcopy,       {.i =  0} },
 	{ ShiftMask,            XK_Insert,      clippaste,      {.i =  0} },
 	{ MODKEY,               XK_v,           clippaste,      {.i =  0} },
+	{ TERMMOD,              XK_Escape,      pastecancel,    {.i =  0} },
 	{ ShiftMask,            XK_Insert,      selpaste,       {.i =  0} },
 	{ TERMMOD,              XK_Num_Lock,    numlock,        {.i =  0} },
 	{ ShiftMask,            XK_Page_Up,     kscrollup,      {.i = -1} },
@@ -0,0 +1,115 @@
+# mkwidth.awk - generate width_data.h from the Unicode Character Database
+# See LICENSE file for copyright and license details.
+#
+# usage: awk -f mkwidth.awk EastAsianWidth.txt DerivedGeneralCategory.txt \
+#            [emoji-data.txt] > width_data.h
+#
+# A rune is 2 columns wide when its East_Asian_Width is W or F or when it
+# has Emoji_Presentation, 0 columns wide when it is a nonspacing, enclosing
+# or format mark (soft hyphen and prepended concatenation marks excepted)
+# or a Hangul medial or final jamo, and 1 column wide otherwise.
+
+function hex(s,    i, n) {
+	n = 0;
+	s = toupper(s);
+	for (i = 1; i <= length(s); i++)
+		n = n * 16 + index("0123456789ABCDEF", substr(s, i, 1)) - 1;
+	return n;
+}
+
+function trim(s) {
+	sub(/^[ \t]+/, "", s);
+	sub(/[ \t]+$/, "", s);
+	return s;
+}
+
+function mark(a, range,    r, lo, hi, i) {
+	if (split(range, r, /\.\./) == 2) {
+		lo = hex(r[1]);
+		hi = hex(r[2]);
+	} else {
+		lo = hi = hex(r[1]);
+	}
+	for (i = lo; i <= hi; i++)
+		a[i] = 1;
+}
+
+BEGIN {
+	FS = ";";
+	# unlisted code points of these ranges default to W
+	mark(wide, "3400..4DBF");
+	mark(wide, "4E00..9FFF");
+	mark(wide, "F900..FAFF");
+	mark(wide, "20000..2FFFD");
+	mark(wide, "30000..3FFFD");
+	mark(zero, "1160..11FF");
+	mark(zero, "D7B0..D7FF");
+	# format marks which are visible: soft hyphen and the
+	# Prepended_Concatenation_Mark runes
+	mark(shown, "00AD");
+	mark(shown, "0600..0605");
+	mark(shown, "06DD");
+	mark(shown, "070F");
+	mark(shown, "0890..0891");
+	mark(shown, "08E2");
+	mark(shown, "110BD");
+	mark(shown, "110CD");
+}
+
+/^[ \t]*(#|$)/ {
+	next;
+}
+
+{
+	sub(/#.*/, "");
+	range = trim($1);
+	prop = trim($2);
+}
+
+FILENAME ~ /EastAsianWidth/ && (prop == "W" || prop == "F") {
+	mark(wide, range);
+}
+
+FILENAME ~ /emoji-data/ && prop == "Emoji_Presentation" {
+	mark(wide, range);
+}
+
+FILENAME ~ /DerivedGeneralCategory/ && (prop == "Mn" || prop == "Me" || prop == "Cf") {
+	mark(zero, range);
+}
+
+END {
+	for (c in shown)
+		delete zero[c];
+
+	nblk = 0;
+	for (b = 0; b < 4352; b++) {
+		s = "";
+		for (i = 0; i < 256; i += 4) {
+			v = 0;
+			for (j = 3; j >= 0; j--) {
+				c = b * 256 + i + j;
+				v = v * 4 + ((c in zero) ? 0 : (c in wide) ? 2 : 1);
+			}
+			s = s sprintf("%s0x%02X,", (i % 32) ? " " : (i ? "\n\t\t" : "\t\t"), v);
+		}
+		if (!(s in blkidx)) {
+			blkidx[s] = nblk;
+			blk[nblk++] = s;
+		}
+		idx[b] = blkidx[s];
+	}
+
+	print "/* generated by mkwidth.awk from the Unicode Character Database, do not edit */";
+	print "";
+	print "/* width of every rune below 0x110000: 2 bits each, 256 runes a block */";
+	printf("static const %s widthidx[4352] = {", (nblk > 256) ? "ushort" : "uchar");
+	for (b = 0; b < 4352; b++)
+		printf("%s%d,", (b % 16) ? " " : "\n\t", idx[b]);
+	print "\n};";
+	print "";
+	print "static const uchar widthblk[][64] = {";
+	for (i = 0; i < nblk; i++)
+		printf("\t{\n%s\n\t},\n", blk[i]);
+	print "};";
+}
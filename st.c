@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -10,15 +11,21 @@
 #include <string.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
+#if defined(__SSE2__)
+ #include <emmintrin.h>
+#endif
 
 #include "st.h"
 #include "win.h"
+#include "width_data.h"
 
 #if   defined(__linux)
  #include <pty.h>
@@ -31,11 +38,22 @@
 /* Arbitrary sizes */
 #define UTF_INVALID   0xFFFD
 #define UTF_SIZ       4
+#define UTF_ACCEPT    0
+#define UTF_REJECT    12
 #define ESC_BUF_SIZ   (128*UTF_SIZ)
 #define ESC_ARG_SIZ   16
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
-#define HISTSIZE      2000
+#define SGR_CACHE_SIZ 64 /* power of two */
+#define SGR_KEY_SIZ   32
+#define TTY_BUF_MAX   (1 << 20)
+#define PASTE_BUF_SIZ (64*1024)
+#define RUN_MIN_REPEAT 4 /* shorter repeats are packed as they are */
+#define HIST_SEG_ROWS 256 /* rows of a segment of the history file */
+#define HIST_SEG_HDR  (HIST_SEG_ROWS * sizeof(uint32_t))
+#define HIST_FILE_MIN (1 << 20)
+#define LINE_SLAB     64 /* rows of a slab of screen rows */
+#define ROW_CHUNK     (1 << 16) /* bytes of a chunk of packed rows, power of two */
 
 /* macros */
 #define IS_SET(flag)		((term.mode & (flag)) != 0)
@@ -43,10 +61,20 @@
 #define ISCONTROLC1(c)		(BETWEEN(c, 0x80, 0x9f))
 #define ISCONTROL(c)		(ISCONTROLC0(c) || ISCONTROLC1(c))
 #define ISDELIM(u)		(u && wcschr(worddelimiters, u))
-#define TLINE(y)		((y) < term.scr ? term.hist[((y) + term.histi - \
-				term.scr + HISTSIZE + 1) % HISTSIZE] : \
+#define PASTING()		(pasteq.active || pasteq.len > 0)
+#define TSCREEN()		(term.ring + term.org + term.nring - term.row)
+#define TLINE(y)		((y) < term.scr ? thistline((y) - term.scr) : \
 				term.line[(y) - term.scr])
-#define TLINE_HIST(y)           ((y) <= HISTSIZE-term.row+2 ? term.hist[(y)] : term.line[(y-HISTSIZE+term.row-3)])
+#define TLINE_HIST(y)		((y) < term.histn ? thistline((y) - term.histn) : \
+				term.line[(y) - term.histn])
+#define ISBLANK(g)		((g).u == ' ' && !(g).mode && (g).bg == defaultbg)
+#define GLYPHEQ(a, b)		((a).u == (b).u && (a).mode == (b).mode && \
+				(a).fg == (b).fg && (a).bg == (b).bg)
+#define ISWIDEPAIR(l, i, n)	(((l)[i].mode & (ATTR_WIDE|ATTR_WRAP)) == \
+				ATTR_WIDE && (i) + 1 < (n) && (l)[(i) + 1].u == 0 && \
+				((l)[(i) + 1].mode & ~ATTR_WRAP) == ATTR_WDUMMY)
+#define THIST(y)		(term.hist[(term.org + term.nring - term.row + (y)) \
+				% term.nring])
 
 enum term_mode {
 	MODE_WRAP        = 1 << 0,
@@ -56,6 +84,7 @@ enum term_mode {
 	MODE_ECHO        = 1 << 4,
 	MODE_PRINT       = 1 << 5,
 	MODE_UTF8        = 1 << 6,
+	MODE_SYNC        = 1 << 7,
 };
 
 enum cursor_movement {
@@ -80,13 +109,60 @@ enum charset {
 };
 
 enum escape_state {
-	ESC_START      = 1,
-	ESC_CSI        = 2,
-	ESC_STR        = 4,  /* DCS, OSC, PM, APC */
-	ESC_ALTCHARSET = 8,
-	ESC_STR_END    = 16, /* a final string was encountered */
-	ESC_TEST       = 32, /* Enter in test mode */
-	ESC_UTF8       = 64,
+	ESC_GROUND,
+	ESC_START,
+	ESC_STR_END,    /* ESC after a final string */
+	ESC_CSI,
+	ESC_ALTCHARSET,
+	ESC_TEST,       /* Enter in test mode */
+	ESC_UTF8,
+	ESC_STR,        /* DCS, OSC, PM, APC */
+	ESC_LAST
+};
+
+enum escape_class {
+	CLS_PRINT,      /* not a control, outside of ASCII */
+	CLS_INTER,      /* 0x20 - 0x3F */
+	CLS_FINAL,      /* 0x40 - 0x7E */
+	CLS_CSI,        /* [ */
+	CLS_TEST,       /* # */
+	CLS_UTF8,       /* % */
+	CLS_CS,         /* ( ) * + */
+	CLS_STR,        /* P _ ^ ] k */
+	CLS_ST,         /* \ */
+	CLS_EXEC,       /* C0 control which leaves a sequence alone */
+	CLS_EXECX,      /* C0 control which ends a final string */
+	CLS_BEL,
+	CLS_CAN,        /* CAN, SUB */
+	CLS_ESC,
+	CLS_C1,
+	CLS_C1STR,      /* DCS, OSC, PM, APC */
+	CLS_LAST
+};
+
+enum escape_action {
+	ACT_NONE,
+	ACT_PRINT,
+	ACT_EXEC,       /* tcontrolcode() */
+	ACT_ESC,        /* eschandle() */
+	ACT_ESCSTART,   /* csireset() */
+	ACT_CSIPUT,
+	ACT_CSIEND,
+	ACT_STRSTART,   /* tstrsequence() */
+	ACT_STRPUT,
+	ACT_STREND,     /* strhandle() */
+	ACT_CSSEL,
+	ACT_CS,         /* tdeftran() */
+	ACT_TEST,       /* tdectest() */
+	ACT_UTF8        /* tdefutf8() */
+};
+
+/* runs of cells of a packed history row, see rowpack() */
+enum run_flags {
+	RUN_REPEAT = 1 << 0, /* one cell, repeated */
+	RUN_ATTR   = 1 << 1, /* mode, fg and bg follow */
+	RUN_WIDE   = 1 << 2, /* each rune is followed by a dummy cell */
+	RUN_WRAP   = 1 << 3, /* the last cell has ATTR_WRAP too */
 };
 
 typedef struct {
@@ -120,9 +196,17 @@ typedef struct {
 	int col;      /* nb col */
 	int maxcol;
 	Line *line;   /* screen */
-	Line *alt;    /* alternate screen */
-	Line hist[HISTSIZE]; /* history buffer */
-	int histi;    /* history index */
+	Line *alt;    /* alternate screen, NULL until it is used */
+	Line *ring;   /* main screen rows and NULL history rows, twice over */
+	int nring;    /* rows in the ring */
+	int org;      /* ring index of the oldest history row */
+	int histn;    /* rows of history in use, rewrapped to the width */
+	int nstore;   /* rows of history stored, as they were written */
+	uchar **hist; /* history rows packed, by ring index */
+	ulong nhist;  /* rows ever moved into the history */
+	Line spare;   /* row left over by the last history row packed */
+	Line *hline;  /* history rows unpacked, term.row of them */
+	ulong *htag;  /* nhist + y of the row y each of hline holds */
 	int scr;      /* scroll back */
 	int *dirty;   /* dirtyness of lines */
 	TCursor c;    /* cursor */
@@ -131,25 +215,125 @@ typedef struct {
 	int top;      /* top    scroll limit */
 	int bot;      /* bottom scroll limit */
 	int mode;     /* terminal mode flags */
-	int esc;      /* escape state flags */
+	int esc;      /* escape parser state */
 	char trantbl[4]; /* charset table translation */
 	int charset;  /* current charset */
 	int icharset; /* selected charset for sequence */
 	int *tabs;
 	Rune lastc;   /* last printed char outside of sequence, 0 if control */
+	struct timespec synctv; /* start of the synchronized update */
+	struct timespec alttv; /* when the alternate screen was left */
 } Term;
 
+/* copy of the dirty rows, rendered while the tty thread goes on */
+typedef struct {
+	int row;      /* nb row */
+	int col;      /* nb col */
+	Line *line;   /* copied rows */
+	int *dirty;   /* rows to draw */
+	Line cline;   /* row of the previous cursor */
+} Snapshot;
+
+/*
+ * history rows older than the histmem newest ones, packed in a file: a
+ * segment of the file is the offset of the end of each of its HIST_SEG_ROWS
+ * rows followed by the rows
+ */
+typedef struct {
+	int fd;
+	uchar *map;   /* the file, mapped */
+	size_t size;  /* bytes of the file */
+	size_t len;   /* bytes of it in use */
+	size_t *seg;  /* offset of each segment */
+	int nseg;
+	int segcap;
+	int dead;     /* first segments, older than the history */
+	ulong first;  /* number of the first row of seg[0] */
+	ulong nrow;   /* rows ever spilled */
+} HistFile;
+
+/*
+ * row of the history rewrapped from rows stored before the last change of
+ * width: cells col to col+len-1 of the logical line which ends at the
+ * stored row row, counted from the newest of those rows
+ */
+typedef struct {
+	int row;
+	int col;
+	int len;
+	int wrap;     /* the line goes on in the next row */
+} Slice;
+
+/*
+ * history rows stored before the last change of width, the oldest nrow of
+ * them, rewrapped lazily: the newest ndone of them make up the n rows of
+ * map, newest first, the others are shown as they are until they are read
+ */
+typedef struct {
+	int nrow;
+	int ndone;
+	Slice *map;
+	int n;
+	int cap;
+	Glyph *line;  /* logical line put together by tflowcat() */
+	int len;
+	int size;
+	int first;    /* oldest and newest stored rows of line, */
+	int last;     /* last -1 if it is not put together from them */
+} Rewrap;
+
+/*
+ * rows of the screens are carved out of slabs of LINE_SLAB rows of
+ * lpool.ncol cells, each row after a cell which points to its slab; the
+ * free ones are threaded through their first cells
+ */
+typedef struct LineSlab LineSlab;
+struct LineSlab {
+	LineSlab *next;
+	int ncol;
+	int nused;    /* rows handed out, in use or not */
+	int nrow;     /* rows in use */
+	int old;      /* of an older width, freed with its last row */
+};
+
+typedef struct {
+	LineSlab *slab; /* slabs of the current width, the newest first */
+	Line free;
+	int ncol;
+} LinePool;
+
+/*
+ * packed history rows, carved one after the other out of chunks of
+ * ROW_CHUNK bytes aligned to that size, the chunk of a row being found
+ * from its address; a row too large for a chunk has one of its own
+ */
+typedef struct {
+	size_t len;   /* bytes carved out, this header included */
+	int nrow;     /* rows in use */
+} RowChunk;
+
 /* CSI Escape sequence structs */
-/* ESC '[' [[ [<priv>] <arg> [;]] <mode> [<mode>]] */
+/* ESC '[' [[ [<priv>] <arg> [;:]] <mode> [<mode>]] */
 typedef struct {
 	char buf[ESC_BUF_SIZ]; /* raw string */
 	size_t len;            /* raw string length */
 	char priv;
 	int arg[ESC_ARG_SIZ];
+	char sub[ESC_ARG_SIZ]; /* arg is a sub-parameter, after ':' */
 	int narg;              /* nb of args */
 	char mode[2];
 } CSIEscape;
 
+/* attribute change of an SGR sequence, independent of the cursor state */
+typedef struct {
+	ushort set;            /* attribute flags to set */
+	ushort clr;            /* attribute flags to clear, before set */
+	int32_t fg;            /* new foreground, or COL_KEEP, COL_DEFAULT */
+	int32_t bg;            /* new background, or COL_KEEP, COL_DEFAULT */
+} SGRDelta;
+
+enum { COL_KEEP = -1, COL_DEFAULT = -2 };
+
 /* STR Escape sequence structs */
 /* ESC type [[ [<priv>] <arg> [;]] <mode>] ESC '\' */
 typedef struct {
@@ -159,22 +343,32 @@ typedef struct {
 	size_t len;            /* raw string length */
 	char *args[STR_ARG_SIZ];
 	int narg;              /* nb of args */
+	int drop;              /* longer than maxstrlen, ignored */
+	int b64;               /* OSC 52 payload: 1 decoded as it arrives,
+	                          -1 kept raw, 0 not known yet */
+	uchar quad[4];         /* base64 digits of an incomplete group */
+	int nquad;             /* nb of digits in quad, -1 after padding */
 } STREscape;
 
 static void execsh(char *, char **);
 static void stty(char **);
-static void sigchld(int);
 static void ttywriteraw(const char *, size_t);
+static size_t ttywritepart(const char *, size_t);
+static size_t ttyflush(void);
+static void ttywake(void);
 
 static void csidump(void);
 static void csihandle(void);
-static void csiparse(void);
+static void csiparse(uchar);
+static void csisgr(void);
+static void sgrstats(void);
 static void csireset(void);
 static void osc_color_response(int, int, int);
-static int eschandle(uchar);
+static void eschandle(uchar);
 static void strdump(void);
 static void strhandle(void);
 static void strparse(void);
+static void strput(const char *, size_t);
 static void strreset(void);
 
 static void tprinter(char *, size_t);
@@ -193,36 +387,84 @@ static void tmoveato(int, int);
 static void tnewline(int);
 static void tputtab(int);
 static void tputc(Rune);
+static int runeclass(Rune);
+static void escaction(int, Rune, const char *, int);
+static void tputascii(const char *, int);
+static void tputlines(const char *, int);
+static Line tlinesnext(int, int);
+static int tscanascii(const char *, int);
+static int tscanlines(const char *, int, int *);
+static int tscanstr(const char *, int);
 static void treset(void);
 static void tscrollup(int, int, int);
-static void tscrolldown(int, int, int);
-static void tsetattr(const int *, int);
+static void tscrolldown(int, int);
+static int tsgrdelta(SGRDelta *, const int *, const char *, int);
+static void tsgrapply(const SGRDelta *);
 static void tsetchar(Rune, const Glyph *, int, int);
 static void tsetdirt(int, int);
 static void tsetscroll(int, int);
 static void tswapscreen(void);
+static void tringmove(int);
+static void tringsync(int, int);
+static void trotate(Line *, int, int, int);
+static void thistpush(int);
+static void tblankline(Line, int);
+static Line linealloc(int);
+static Line linerealloc(Line, int);
+static void linefree(Line);
+static LineSlab *lineslab(const Line);
+static void tringgrow(void);
+static Line tringnext(void);
+static void thistpack(int);
+static Line thistline(int);
+static const uchar *thistrow(int);
+static uchar *thistpop(void);
+static void thistdrop(int);
+static void thistwrap(int);
+static int thistjoin(int);
+static void thistspill(const uchar *);
+static uchar *thistunspill(void);
+static const uchar *thistload(ulong);
+static int thistmap(size_t);
+static void thistclose(void);
+static void treflow(int);
+static void tflowcat(const Glyph *, int);
+static int tflowcut(int, int);
+static void tflowrow(Line, int, int, int);
+static uchar *rowpack(const Glyph *, int);
+static uchar *rowalloc(size_t);
+static void rowfree(uchar *);
+static int rowhead(const uchar *, uint *);
+static int rowlen(const Glyph *, int);
+static const uchar *rowunpack(Line, int, const uchar *);
+static uchar *packnum(uchar *, uint);
+static const uchar *unpacknum(const uchar *, uint *);
+static uchar *packrun(uchar *, int, const Glyph *, Glyph *, int);
+static int packrepeat(const Glyph *, int, int);
+static uchar *packcells(uchar *, const Glyph *, int, int, int, Glyph *);
 static void tsetmode(int, int, const int *, int);
 static int twrite(const char *, int, int);
 static void tcontrolcode(uchar );
 static void tdectest(char );
 static void tdefutf8(char);
-static int32_t tdefcolor(const int *, int *, int);
+static int32_t tdefcolor(const int *, const char *, int *, int);
 static void tdeftran(char);
 static void tstrsequence(uchar);
 
-static void drawregion(int, int, int, int);
+static void snapline(Line, const Line, int);
 
 static void selnormalize(void);
 static void selscroll(int, int);
 static void selsnap(int *, int *, int);
 
 static size_t utf8decode(const char *, Rune *, size_t);
-static Rune utf8decodebyte(char, size_t *);
 static char utf8encodebyte(Rune, size_t);
 static size_t utf8validate(Rune *, size_t);
+static int runewidth(Rune);
 
-static char *base64dec(const char *);
-static char base64dec_getc(const char **);
+static int base64quad(char *, const uchar *);
+static void base64put(const char *, size_t);
+static void base64end(void);
 
 static ssize_t xwrite(int, const char *, size_t);
 
@@ -230,10 +472,157 @@ static ssize_t xwrite(int, const char *, size_t);
 static Term term;
 static Selection sel;
 static CSIEscape csiescseq;
+static struct {
+	struct {
+		char key[SGR_KEY_SIZ]; /* raw CSI bytes */
+		uchar len;
+		SGRDelta d;
+	} ent[SGR_CACHE_SIZ];
+	ulong hits, misses;
+} sgrcache;
 static STREscape strescseq;
 static int iofd = 1;
 static int cmdfd;
 static pid_t pid;
+static int ttyhup; /* the tty hung up, it is read no more */
+static pthread_mutex_t termlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t turnlock = PTHREAD_MUTEX_INITIALIZER;
+static int wakefd[2];
+static struct {
+	char *buf;   /* bytes not written to the tty yet */
+	size_t off;  /* first of them */
+	size_t len;
+	size_t siz;
+	int wake[2]; /* tells ttyloop() that bytes were queued */
+} outq = { .wake = { -1, -1 } };
+static struct {
+	char buf[PASTE_BUF_SIZ]; /* pasted bytes, written before outq */
+	size_t off;
+	size_t len;
+	int active;  /* a paste is running */
+	int bracket; /* it started with ESC [200~ */
+} pasteq;
+static Snapshot snap;
+static HistFile hfile = { .fd = -1 };
+static Rewrap rewrap = { .last = -1 };
+static LinePool lpool;
+static RowChunk *rchunk; /* chunk rows are carved out of */
+static TCursor csave[2]; /* cursors saved by tcursor(), main and alt screen */
+
+/*
+ * UTF-8 decoder DFA, after Bjoern Hoehrmann's "Flexible and Economical
+ * UTF-8 Decoder". Bytes map to a class, and a state plus a class map to
+ * the next state. States are multiples of 12 so no multiplication is
+ * needed; overlong forms, surrogates and values above U+10FFFF reject.
+ */
+static const uchar utfclass[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	8, 8, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	10, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 3, 3, 11, 6, 6, 6, 5, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+};
+static const uchar utfstate[108] = {
+	 0, 12, 24, 36, 60, 96, 84, 12, 12, 12, 48, 72, /* UTF_ACCEPT */
+	12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, /* UTF_REJECT */
+	12,  0, 12, 12, 12, 12, 12,  0, 12,  0, 12, 12, /* 1 byte left */
+	12, 24, 12, 12, 12, 12, 12, 24, 12, 24, 12, 12, /* 2 bytes left */
+	12, 12, 12, 12, 12, 12, 12, 24, 12, 12, 12, 12, /* E0: A0-BF */
+	12, 24, 12, 12, 12, 12, 12, 12, 12, 24, 12, 12, /* ED: 80-9F */
+	12, 12, 12, 12, 12, 12, 12, 36, 12, 36, 12, 12, /* F0: 90-BF */
+	12, 36, 12, 12, 12, 12, 12, 36, 12, 36, 12, 12, /* F1-F3: 80-BF */
+	12, 36, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, /* F4: 80-8F */
+};
+
+/*
+ * Escape sequence parser: every rune falls into a class, and the parser
+ * state plus the class give the action to run and the next state, in the
+ * spirit of the DEC VT500 state machine. Controls act inside sequences;
+ * only CAN, SUB, ESC and C1 controls interrupt one.
+ */
+static const uchar asciiclass[128] = {
+	/* 0x00 */ CLS_EXEC, CLS_EXECX, CLS_EXECX, CLS_EXECX, CLS_EXECX, CLS_EXEC, CLS_EXECX, CLS_BEL,
+	/* 0x08 */ CLS_EXEC, CLS_EXEC, CLS_EXEC, CLS_EXEC, CLS_EXEC, CLS_EXEC, CLS_EXEC, CLS_EXEC,
+	/* 0x10 */ CLS_EXECX, CLS_EXEC, CLS_EXECX, CLS_EXEC, CLS_EXECX, CLS_EXECX, CLS_EXECX, CLS_EXECX,
+	/* 0x18 */ CLS_CAN, CLS_EXECX, CLS_CAN, CLS_ESC, CLS_EXECX, CLS_EXECX, CLS_EXECX, CLS_EXECX,
+	/* 0x20 */ CLS_INTER, CLS_INTER, CLS_INTER, CLS_TEST, CLS_INTER, CLS_UTF8, CLS_INTER, CLS_INTER,
+	/* 0x28 */ CLS_CS, CLS_CS, CLS_CS, CLS_CS, CLS_INTER, CLS_INTER, CLS_INTER, CLS_INTER,
+	/* 0x30 */ CLS_INTER, CLS_INTER, CLS_INTER, CLS_INTER, CLS_INTER, CLS_INTER, CLS_INTER, CLS_INTER,
+	/* 0x38 */ CLS_INTER, CLS_INTER, CLS_INTER, CLS_INTER, CLS_INTER, CLS_INTER, CLS_INTER, CLS_INTER,
+	/* 0x40 */ CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL,
+	/* 0x48 */ CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL,
+	/* 0x50 */ CLS_STR, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL,
+	/* 0x58 */ CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_CSI, CLS_ST, CLS_STR, CLS_STR, CLS_STR,
+	/* 0x60 */ CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL,
+	/* 0x68 */ CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_STR, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL,
+	/* 0x70 */ CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL,
+	/* 0x78 */ CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_FINAL, CLS_EXEC,
+};
+
+#define T(a, s)	{ ACT_##a, ESC_##s }
+static const struct {
+	uchar act;
+	uchar next;
+} esctrans[ESC_LAST][CLS_LAST] = {
+	/*
+	 * PRINT      INTER      FINAL      CSI
+	 * TEST       UTF8       CS         STR
+	 * ST         EXEC       EXECX      BEL
+	 * CAN        ESC        C1         C1STR
+	 */
+	[ESC_GROUND] = {
+		T(PRINT, GROUND), T(PRINT, GROUND), T(PRINT, GROUND), T(PRINT, GROUND),
+		T(PRINT, GROUND), T(PRINT, GROUND), T(PRINT, GROUND), T(PRINT, GROUND),
+		T(PRINT, GROUND), T(EXEC, GROUND), T(EXEC, GROUND), T(EXEC, GROUND),
+		T(EXEC, GROUND), T(ESCSTART, START), T(EXEC, GROUND), T(STRSTART, STR),
+	},
+	[ESC_START] = {
+		T(ESC, GROUND), T(ESC, GROUND), T(ESC, GROUND), T(NONE, CSI),
+		T(NONE, TEST), T(NONE, UTF8), T(CSSEL, ALTCHARSET), T(STRSTART, STR),
+		T(NONE, GROUND), T(EXEC, START), T(EXEC, START), T(EXEC, START),
+		T(EXEC, START), T(ESCSTART, START), T(EXEC, START), T(STRSTART, STR),
+	},
+	[ESC_STR_END] = {
+		T(ESC, GROUND), T(ESC, GROUND), T(ESC, GROUND), T(NONE, CSI),
+		T(NONE, TEST), T(NONE, UTF8), T(CSSEL, ALTCHARSET), T(STRSTART, STR),
+		T(STREND, GROUND), T(EXEC, STR_END), T(EXEC, START), T(STREND, START),
+		T(EXEC, START), T(ESCSTART, STR_END), T(EXEC, START), T(STRSTART, STR),
+	},
+	[ESC_CSI] = {
+		T(CSIPUT, CSI), T(CSIPUT, CSI), T(CSIEND, GROUND), T(CSIEND, GROUND),
+		T(CSIPUT, CSI), T(CSIPUT, CSI), T(CSIPUT, CSI), T(CSIEND, GROUND),
+		T(CSIEND, GROUND), T(EXEC, CSI), T(EXEC, CSI), T(EXEC, CSI),
+		T(EXEC, CSI), T(ESCSTART, START), T(EXEC, CSI), T(STRSTART, STR),
+	},
+	[ESC_ALTCHARSET] = {
+		T(CS, GROUND), T(CS, GROUND), T(CS, GROUND), T(CS, GROUND),
+		T(CS, GROUND), T(CS, GROUND), T(CS, GROUND), T(CS, GROUND),
+		T(CS, GROUND), T(EXEC, ALTCHARSET), T(EXEC, ALTCHARSET), T(EXEC, ALTCHARSET),
+		T(EXEC, ALTCHARSET), T(ESCSTART, START), T(EXEC, ALTCHARSET), T(STRSTART, STR),
+	},
+	[ESC_TEST] = {
+		T(TEST, GROUND), T(TEST, GROUND), T(TEST, GROUND), T(TEST, GROUND),
+		T(TEST, GROUND), T(TEST, GROUND), T(TEST, GROUND), T(TEST, GROUND),
+		T(TEST, GROUND), T(EXEC, TEST), T(EXEC, TEST), T(EXEC, TEST),
+		T(EXEC, TEST), T(ESCSTART, START), T(EXEC, TEST), T(STRSTART, STR),
+	},
+	[ESC_UTF8] = {
+		T(UTF8, GROUND), T(UTF8, GROUND), T(UTF8, GROUND), T(UTF8, GROUND),
+		T(UTF8, GROUND), T(UTF8, GROUND), T(UTF8, GROUND), T(UTF8, GROUND),
+		T(UTF8, GROUND), T(EXEC, UTF8), T(EXEC, UTF8), T(EXEC, UTF8),
+		T(EXEC, UTF8), T(ESCSTART, START), T(EXEC, UTF8), T(STRSTART, STR),
+	},
+	[ESC_STR] = {
+		T(STRPUT, STR), T(STRPUT, STR), T(STRPUT, STR), T(STRPUT, STR),
+		T(STRPUT, STR), T(STRPUT, STR), T(STRPUT, STR), T(STRPUT, STR),
+		T(STRPUT, STR), T(STRPUT, STR), T(STRPUT, STR), T(STREND, GROUND),
+		T(EXEC, GROUND), T(ESCSTART, STR_END), T(EXEC, GROUND), T(STRSTART, STR),
+	},
+};
+#undef T
 
 static const uchar utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const uchar utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
@@ -293,34 +682,24 @@ xstrdup(const char *s)
 size_t
 utf8decode(const char *c, Rune *u, size_t clen)
 {
-	size_t i, j, len, type;
+	size_t i;
+	uint state, type;
 	Rune udecoded;
 
 	*u = UTF_INVALID;
-	if (!clen)
-		return 0;
-	udecoded = utf8decodebyte(c[0], &len);
-	if (!BETWEEN(len, 1, UTF_SIZ))
-		return 1;
-	for (i = 1, j = 1; i < clen && j < len; ++i, ++j) {
-		udecoded = (udecoded << 6) | utf8decodebyte(c[i], &type);
-		if (type != 0)
-			return j;
+	for (i = 0, state = UTF_ACCEPT, udecoded = 0; i < clen; ++i) {
+		type = utfclass[(uchar)c[i]];
+		udecoded = (state != UTF_ACCEPT) ? (udecoded << 6) | (c[i] & 0x3F)
+		                                 : (0xFF >> type) & (uchar)c[i];
+		state = utfstate[state + type];
+		if (state == UTF_ACCEPT) {
+			*u = udecoded;
+			return i + 1;
+		}
+		/* invalid sequences are replaced up to the offending byte */
+		if (state == UTF_REJECT)
+			return MAX(i, 1);
 	}
-	if (j < len)
-		return 0;
-	*u = udecoded;
-	utf8validate(u, len);
-
-	return len;
-}
-
-Rune
-utf8decodebyte(char c, size_t *i)
-{
-	for (*i = 0; *i < LEN(utfmask); ++(*i))
-		if (((uchar)c & utfmask[*i]) == utfbyte[*i])
-			return (uchar)c & ~utfmask[*i];
 
 	return 0;
 }
@@ -360,50 +739,114 @@ utf8validate(Rune *u, size_t i)
 	return i;
 }
 
-char
-base64dec_getc(const char **src)
+/* width in columns of a printable rune, see mkwidth.awk */
+int
+runewidth(Rune u)
 {
-	while (**src && !isprint((unsigned char)**src))
-		(*src)++;
-	return **src ? *((*src)++) : '=';  /* emulate padding if string ends */
+	if (u > 0x10FFFF)
+		return 1;
+	return widthblk[widthidx[u >> 8]][(u & 0xFF) >> 2] >> ((u & 3) << 1) & 3;
 }
 
-char *
-base64dec(const char *src)
-{
-	size_t in_len = strlen(src);
-	char *result, *dst;
-	static const char base64_digits[256] = {
-		[43] = 62, 0, 0, 0, 63, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61,
-		0, 0, 0, -1, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
-		13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 0, 0, 0, 0,
-		0, 0, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39,
-		40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51
-	};
+/*
+ * value of every byte as a base64 digit: 0x40 is padding, 0x80 is skipped.
+ * Other printable bytes count as 0, as they always did.
+ */
+static const uchar base64val[256] = {
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	   0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,   62,    0,    0,    0,   63,
+	  52,   53,   54,   55,   56,   57,   58,   59,   60,   61,    0,    0,    0, 0x40,    0,    0,
+	   0,    0,    1,    2,    3,    4,    5,    6,    7,    8,    9,   10,   11,   12,   13,   14,
+	  15,   16,   17,   18,   19,   20,   21,   22,   23,   24,   25,    0,    0,    0,    0,    0,
+	   0,   26,   27,   28,   29,   30,   31,   32,   33,   34,   35,   36,   37,   38,   39,   40,
+	  41,   42,   43,   44,   45,   46,   47,   48,   49,   50,   51,    0,    0,    0,    0, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
 
-	if (in_len % 4)
-		in_len += 4 - (in_len % 4);
-	result = dst = xmalloc(in_len / 4 * 3 + 1);
-	while (*src) {
-		int a = base64_digits[(unsigned char) base64dec_getc(&src)];
-		int b = base64_digits[(unsigned char) base64dec_getc(&src)];
-		int c = base64_digits[(unsigned char) base64dec_getc(&src)];
-		int d = base64_digits[(unsigned char) base64dec_getc(&src)];
-
-		/* invalid input. 'a' can be -1, e.g. if src is "\n" (c-str) */
-		if (a == -1 || b == -1)
-			break;
+/* decodes a complete group of four digits, returns the bytes written */
+int
+base64quad(char *d, const uchar *q)
+{
+	if ((q[0] | q[1]) & 0x40)
+		return 0;
+	d[0] = q[0] << 2 | q[1] >> 4;
+	if (q[2] & 0x40)
+		return 1;
+	d[1] = q[1] << 4 | q[2] >> 2;
+	if (q[3] & 0x40)
+		return 2;
+	d[2] = q[2] << 6 | q[3];
+	return 3;
+}
 
-		*dst++ = (a << 2) | ((b & 0x30) >> 4);
-		if (c == -1)
-			break;
-		*dst++ = ((b & 0x0f) << 4) | ((c & 0x3c) >> 2);
-		if (d == -1)
+/*
+ * Decodes base64 text, appending to the string sequence. Decoding never
+ * writes more than it reads, so s may point into the sequence buffer past
+ * its length. Runs of plain digits are done four at a time; padding ends
+ * the payload.
+ */
+void
+base64put(const char *s, size_t n)
+{
+	const uchar *p = (const uchar *)s, *e = p + n;
+	uchar *q = strescseq.quad, c;
+	char *d = strescseq.buf + strescseq.len;
+	uint v;
+
+	if (strescseq.nquad < 0)
+		return;
+	while (p < e) {
+		if (strescseq.nquad == 0) {
+			while (e - p >= 4 && !((base64val[p[0]] |
+			    base64val[p[1]] | base64val[p[2]] |
+			    base64val[p[3]]) & 0xC0)) {
+				v = base64val[p[0]] << 18 | base64val[p[1]] << 12 |
+				    base64val[p[2]] << 6 | base64val[p[3]];
+				d[0] = v >> 16;
+				d[1] = v >> 8;
+				d[2] = v;
+				d += 3;
+				p += 4;
+			}
+			if (p == e)
+				break;
+		}
+		if ((c = base64val[*p++]) & 0x80)
+			continue;
+		q[strescseq.nquad++] = c;
+		if (strescseq.nquad < 4)
+			continue;
+		strescseq.nquad = 0;
+		d += base64quad(d, q);
+		if ((q[0] | q[1] | q[2] | q[3]) & 0x40) {
+			strescseq.nquad = -1;
 			break;
-		*dst++ = ((c & 0x03) << 6) | d;
+		}
 	}
-	*dst = '\0';
-	return result;
+	strescseq.len = d - strescseq.buf;
+}
+
+/* pads an incomplete last group, as if the string ended with '=' */
+void
+base64end(void)
+{
+	int i;
+
+	if (strescseq.nquad <= 0)
+		return;
+	for (i = strescseq.nquad; i < 4; i++)
+		strescseq.quad[i] = 0x40;
+	strescseq.len += base64quad(strescseq.buf + strescseq.len,
+	                            strescseq.quad);
+	strescseq.nquad = -1;
 }
 
 void
@@ -687,6 +1130,7 @@ execsh(char *cmd, char **args)
 {
 	char *sh, *prog, *arg;
 	const struct passwd *pw;
+	sigset_t set;
 
 	errno = 0;
 	if ((pw = getpwuid(getuid())) == NULL) {
@@ -723,6 +1167,9 @@ execsh(char *cmd, char **args)
 	setenv("HOME", pw->pw_dir, 1);
 	setenv("TERM", termname, 1);
 
+	/* run() may have blocked SIGCHLD to read it from a signalfd */
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
 	signal(SIGCHLD, SIG_DFL);
 	signal(SIGHUP, SIG_DFL);
 	signal(SIGINT, SIG_DFL);
@@ -750,6 +1197,7 @@ sigchld(int a)
 		die("child exited with status %d\n", WEXITSTATUS(stat));
 	else if (WIFSIGNALED(stat))
 		die("child terminated due to signal %d\n", WTERMSIG(stat));
+	sgrstats();
 	_exit(0);
 }
 
@@ -798,6 +1246,7 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 			    line, strerror(errno));
 		dup2(cmdfd, 0);
 		stty(args);
+		fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
 		return cmdfd;
 	}
 
@@ -833,6 +1282,7 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 #endif
 		close(s);
 		cmdfd = m;
+		fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
 		signal(SIGCHLD, sigchld);
 		break;
 	}
@@ -842,27 +1292,133 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 size_t
 ttyread(void)
 {
-	static char buf[BUFSIZ];
-	static int buflen = 0;
-	int ret, written;
-
-	/* append read bytes to unprocessed bytes */
-	ret = read(cmdfd, buf+buflen, LEN(buf)-buflen);
+	static char *buf;
+	static size_t bufsiz, buflen;
+	struct timespec start, now;
+	size_t written, total = 0;
+	ssize_t ret;
+	int full;
+
+	if (!buf)
+		buf = xmalloc(bufsiz = BUFSIZ);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		/* append read bytes to unprocessed bytes */
+		ret = read(cmdfd, buf+buflen, bufsiz-buflen);
+		if (ret == 0 || (ret < 0 && errno == EIO)) {
+			/* the X thread exits once it reaps the child */
+			ttyhup = 1;
+			break;
+		}
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR)
+				break;
+			die("couldn't read from shell: %s\n", strerror(errno));
+		}
+		full = (buflen += ret) == bufsiz;
+		total += ret;
 
-	switch (ret) {
-	case 0:
-		exit(0);
-	case -1:
-		die("couldn't read from shell: %s\n", strerror(errno));
-	default:
-		buflen += ret;
 		written = twrite(buf, buflen, 0);
 		buflen -= written;
 		/* keep any incomplete UTF-8 byte sequence for the next call */
 		if (buflen > 0)
 			memmove(buf, buf + written, buflen);
-		return ret;
+
+		/* the shell writes faster than we read: read bigger chunks */
+		if (full && bufsiz < TTY_BUF_MAX)
+			buf = xrealloc(buf, bufsiz *= 2);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (TIMEDIFF(now, start) < parsebudget);
+
+	return total;
+}
+
+static void *
+ttyloop(void *unused)
+{
+	fd_set rfd, wfd;
+	char buf[64];
+	size_t n, pasted;
+	int hup;
+
+	for (;;) {
+		FD_ZERO(&rfd);
+		FD_ZERO(&wfd);
+		FD_SET(cmdfd, &rfd);
+		FD_SET(outq.wake[0], &rfd);
+		tlock();
+		if (pasteq.len > 0 || (outq.len > 0 && !PASTING()))
+			FD_SET(cmdfd, &wfd);
+		tunlock();
+
+		if (select(MAX(cmdfd, outq.wake[0])+1, &rfd, &wfd, NULL,
+		           NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("select failed: %s\n", strerror(errno));
+		}
+		if (FD_ISSET(outq.wake[0], &rfd))
+			while (read(outq.wake[0], buf, sizeof(buf)) > 0)
+				;
+
+		tlock();
+		pasted = FD_ISSET(cmdfd, &wfd) ? ttyflush() : 0;
+		n = FD_ISSET(cmdfd, &rfd) ? ttyread() : 0;
+		hup = ttyhup;
+		tunlock();
+
+		/*
+		 * wake the X thread up to draw, to fetch more of a paste or
+		 * to reap the child; a full pipe is awake already
+		 */
+		if ((n > 0 || pasted > 0 || hup) && write(wakefd[1], "", 1) < 0 && errno != EAGAIN)
+			die("write to wake pipe failed: %s\n", strerror(errno));
+		if (hup)
+			break;
+	}
+
+	return NULL;
+}
+
+int
+ttythread(void)
+{
+	pthread_t th;
+	int i, *fds[] = { wakefd, outq.wake };
+
+	for (i = 0; i < LEN(fds); i++) {
+		if (pipe(fds[i]) < 0)
+			die("pipe failed: %s\n", strerror(errno));
+		fcntl(fds[i][0], F_SETFL, fcntl(fds[i][0], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[i][1], F_SETFL, fcntl(fds[i][1], F_GETFL) | O_NONBLOCK);
 	}
+
+	if ((errno = pthread_create(&th, NULL, ttyloop, NULL)))
+		die("pthread_create failed: %s\n", strerror(errno));
+	pthread_detach(th);
+
+	return wakefd[0];
+}
+
+void
+tlock(void)
+{
+	/*
+	 * Whoever waits for termlock holds turnlock, so the tty thread
+	 * cannot take termlock again right after a ttyread() of
+	 * parsebudget ms while the X thread waits to handle a key press.
+	 */
+	pthread_mutex_lock(&turnlock);
+	pthread_mutex_lock(&termlock);
+	pthread_mutex_unlock(&turnlock);
+}
+
+void
+tunlock(void)
+{
+	pthread_mutex_unlock(&termlock);
 }
 
 void
@@ -896,61 +1452,159 @@ ttywrite(const char *s, size_t n, int may_echo)
 	}
 }
 
+size_t
+ttywritepart(const char *s, size_t n)
+{
+	ssize_t r;
+
+	/* what nobody reads any more is dropped */
+	if (ttyhup)
+		return n;
+	if ((r = write(cmdfd, s, n)) >= 0)
+		return r;
+	if (errno == EIO)
+		return n;
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		die("write error on tty: %s\n", strerror(errno));
+	return 0;
+}
+
+/*
+ * Writes the paste, then what was queued meanwhile: keys and replies
+ * wait for the whole paste, so none of them lands between its brackets.
+ * Returns the bytes of the paste written.
+ */
+size_t
+ttyflush(void)
+{
+	size_t r = 0, w;
+
+	if (pasteq.len > 0) {
+		r = ttywritepart(pasteq.buf + pasteq.off, pasteq.len);
+		pasteq.off += r;
+		if ((pasteq.len -= r) == 0)
+			pasteq.off = 0;
+	}
+	if (PASTING() || outq.len == 0)
+		return r;
+
+	w = ttywritepart(outq.buf + outq.off, outq.len);
+	outq.off += w;
+	if ((outq.len -= w) == 0) {
+		free(outq.buf);
+		outq.buf = NULL;
+		outq.off = outq.siz = 0;
+	}
+	return r;
+}
+
+void
+ttywake(void)
+{
+	if (outq.wake[1] >= 0 && write(outq.wake[1], "", 1) < 0 &&
+	    errno != EAGAIN)
+		die("write to wake pipe failed: %s\n", strerror(errno));
+}
+
 void
 ttywriteraw(const char *s, size_t n)
 {
-	fd_set wfd, rfd;
-	ssize_t r;
-	size_t lim = 256;
+	size_t r;
 
 	/*
-	 * Remember that we are using a pty, which might be a modem line.
-	 * Writing too much will clog the line. That's why we are doing this
-	 * dance.
-	 * FIXME: Migrate the world to Plan 9.
+	 * Write what the tty takes right away and queue the rest, all of
+	 * it while a paste goes on; ttyloop() writes it out when the tty
+	 * is writable again, and goes on reading meanwhile.
 	 */
-	while (n > 0) {
-		FD_ZERO(&wfd);
-		FD_ZERO(&rfd);
-		FD_SET(cmdfd, &wfd);
-		FD_SET(cmdfd, &rfd);
+	if (outq.len == 0 && !PASTING()) {
+		r = ttywritepart(s, n);
+		s += r;
+		n -= r;
+	}
+	if (n == 0)
+		return;
 
-		/* Check if we can write. */
-		if (pselect(cmdfd+1, &rfd, &wfd, NULL, NULL, NULL) < 0) {
-			if (errno == EINTR)
-				continue;
-			die("select failed: %s\n", strerror(errno));
+	if (outq.off + outq.len + n > outq.siz) {
+		if (outq.off > 0)
+			memmove(outq.buf, outq.buf + outq.off, outq.len);
+		outq.off = 0;
+		if (outq.len + n > outq.siz) {
+			outq.siz = MAX(2 * outq.siz, outq.len + n);
+			outq.buf = xrealloc(outq.buf, outq.siz);
 		}
-		if (FD_ISSET(cmdfd, &wfd)) {
-			/*
-			 * Only write the bytes written by ttywrite() or the
-			 * default of 256. This seems to be a reasonable value
-			 * for a serial line. Bigger values might clog the I/O.
-			 */
-			if ((r = write(cmdfd, s, (n < lim)? n : lim)) < 0)
-				goto write_error;
-			if (r < n) {
-				/*
-				 * We weren't able to write out everything.
-				 * This means the buffer is getting full
-				 * again. Empty it.
-				 */
-				if (n < lim)
-					lim = ttyread();
-				n -= r;
-				s += r;
-			} else {
-				/* All bytes have been written. */
-				break;
-			}
+	}
+	memcpy(outq.buf + outq.off + outq.len, s, n);
+	outq.len += n;
+	ttywake();
+}
+
+size_t
+ttypasteroom(void)
+{
+	/* each byte may become two, and room is left for both brackets */
+	if (pasteq.len + 12 >= PASTE_BUF_SIZ)
+		return 0;
+	return (PASTE_BUF_SIZ - pasteq.len - 12) / 2;
+}
+
+void
+ttypaste(const char *s, size_t n, int bracket, int last)
+{
+	Arg arg = (Arg) { .i = term.scr };
+	char *p, *start;
+
+	if (pasteq.off > 0)
+		memmove(pasteq.buf, pasteq.buf + pasteq.off, pasteq.len);
+	pasteq.off = 0;
+	p = pasteq.buf + pasteq.len;
+
+	if (!pasteq.active) {
+		kscrolldown(&arg);
+		pasteq.active = 1;
+		if ((pasteq.bracket = bracket)) {
+			memcpy(p, "\033[200~", 6);
+			p += 6;
+		}
+	}
+
+	/*
+	 * As seen in getsel(), lines end in '\r' in the terminal. This
+	 * rewrites '\n' and, like ttywrite(), adds the '\n' of MODE_CRLF
+	 * in the same pass.
+	 */
+	for (start = p; n > 0; n--, s++) {
+		if (*s == '\n' || *s == '\r') {
+			*p++ = '\r';
+			if (IS_SET(MODE_CRLF))
+				*p++ = '\n';
+		} else {
+			*p++ = *s;
+		}
+	}
+	if (IS_SET(MODE_ECHO))
+		twrite(start, p - start, 1);
+
+	if (last) {
+		if (pasteq.bracket) {
+			memcpy(p, "\033[201~", 6);
+			p += 6;
 		}
-		if (FD_ISSET(cmdfd, &rfd))
-			lim = ttyread();
+		pasteq.active = 0;
 	}
-	return;
+	pasteq.len = p - pasteq.buf;
+	ttywake();
+}
+
+void
+ttypastecancel(void)
+{
+	if (!pasteq.active && pasteq.len == 0)
+		return;
 
-write_error:
-	die("write error on tty: %s\n", strerror(errno));
+	/* drop what the tty did not take yet, but close the bracket */
+	pasteq.off = pasteq.len = 0;
+	pasteq.active = 1;
+	ttypaste(NULL, 0, 0, 1);
 }
 
 void
@@ -966,6 +1620,21 @@ ttyresize(int tw, int th)
 		fprintf(stderr, "Couldn't set window size: %s\n", strerror(errno));
 }
 
+/*
+ * Called by the X thread when the tty thread woke it up: once the tty
+ * hung up, st exits through sigchld() as the child is reaped, right away
+ * if there is no child.
+ */
+void
+ttyreap(void)
+{
+	if (!ttyhup)
+		return;
+	if (!pid)
+		exit(0);
+	sigchld(SIGCHLD);
+}
+
 void
 ttyhangup(void)
 {
@@ -1000,6 +1669,26 @@ tsetdirt(int top, int bot)
 		term.dirty[i] = 1;
 }
 
+/*
+ * returns the ms drawing is still held for by a synchronized update, which
+ * ends after timeout ms even if the application never ends it
+ */
+int
+tinsync(uint timeout)
+{
+	struct timespec now;
+	int left;
+
+	if (!IS_SET(MODE_SYNC))
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((left = timeout - TIMEDIFF(now, term.synctv)) <= 0) {
+		term.mode &= ~MODE_SYNC;
+		return 0;
+	}
+	return left;
+}
+
 void
 tsetdirtattr(int attr)
 {
@@ -1024,14 +1713,13 @@ tfulldirt(void)
 void
 tcursor(int mode)
 {
-	static TCursor c[2];
 	int alt = IS_SET(MODE_ALTSCREEN);
 
 	if (mode == CURSOR_SAVE) {
-		c[alt] = term.c;
+		csave[alt] = term.c;
 	} else if (mode == CURSOR_LOAD) {
-		term.c = c[alt];
-		tmoveto(c[alt].x, c[alt].y);
+		term.c = csave[alt];
+		tmoveto(csave[alt].x, csave[alt].y);
 	}
 }
 
@@ -1051,16 +1739,17 @@ treset(void)
 		term.tabs[i] = 1;
 	term.top = 0;
 	term.bot = term.row - 1;
+	if (IS_SET(MODE_ALTSCREEN))
+		tswapscreen();
 	term.mode = MODE_WRAP|MODE_UTF8;
 	memset(term.trantbl, CS_USA, sizeof(term.trantbl));
 	term.charset = 0;
 
-	for (i = 0; i < 2; i++) {
-		tmoveto(0, 0);
-		tcursor(CURSOR_SAVE);
-		tclearregion(0, 0, term.col-1, term.row-1);
-		tswapscreen();
-	}
+	tmoveto(0, 0);
+	tcursor(CURSOR_SAVE);
+	csave[1] = csave[0];
+	tclearregion(0, 0, term.col-1, term.row-1);
+	taltfree(0);
 }
 
 void
@@ -1069,19 +1758,57 @@ tnew(int col, int row)
 	term = (Term){ .c = { .attr = { .fg = defaultfg, .bg = defaultbg } } };
 	tresize(col, row);
 	treset();
+	atexit(sgrstats);
 }
 
 void
 tswapscreen(void)
 {
-	Line *tmp = term.line;
+	Line *tmp;
+	int i, j;
 
+	/* blank in the default colors, as tnew() made the screens */
+	if (!term.alt) {
+		term.alt = xmalloc(term.row * sizeof(Line));
+		for (i = 0; i < term.row; i++) {
+			term.alt[i] = linealloc(term.maxcol);
+			for (j = 0; j < term.maxcol; j++) {
+				term.alt[i][j] = (Glyph){ .u = ' ',
+				                          .fg = defaultfg,
+				                          .bg = defaultbg };
+			}
+		}
+	}
+	tmp = term.line;
 	term.line = term.alt;
 	term.alt = tmp;
 	term.mode ^= MODE_ALTSCREEN;
 	tfulldirt();
 }
 
+/*
+ * Frees the alternate screen once it was left timeout ms ago, and returns
+ * the ms left until then, 0 if there is nothing to free.
+ */
+int
+taltfree(uint timeout)
+{
+	struct timespec now;
+	int i, left;
+
+	if (IS_SET(MODE_ALTSCREEN) || !term.alt)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((left = timeout - TIMEDIFF(now, term.alttv)) > 0)
+		return left;
+	for (i = 0; i < term.row; i++)
+		linefree(term.alt[i]);
+	free(term.alt);
+	term.alt = NULL;
+
+	return 0;
+}
+
 void
 kscrolldown(const Arg* a)
 {
@@ -1108,36 +1835,1124 @@ kscrollup(const Arg* a)
 	if (n < 0)
 		n = term.row + n;
 
-	if (term.scr <= HISTSIZE-n) {
+	thistwrap(term.scr + n);
+	n = MIN(n, term.histn - term.scr);
+	if (n > 0) {
 		term.scr += n;
 		selscroll(0, n);
 		tfulldirt();
 	}
 }
 
+/*
+ * The ring holds the history followed by the main screen, oldest row
+ * first, and holds its rows twice, one copy after the other, so that
+ * the main screen and the history above it are always one contiguous
+ * window of it: TSCREEN()[y] for y from term.row-term.nring to
+ * term.row-1, of which the history rows above -term.nstore are not in
+ * use yet. Moving the origin scrolls every row of that window at once;
+ * rows which change places within it have their other copy put in line
+ * by tringsync(). A row which goes into the history is packed into
+ * term.hist, at the same index of the ring, and leaves NULL behind.
+ */
 void
-tscrolldown(int orig, int n, int copyhist)
+tringmove(int n)
 {
-	int i;
-	Line temp;
+	term.org = (term.org + n) % term.nring;
+	if (IS_SET(MODE_ALTSCREEN))
+		term.alt = TSCREEN();
+	else
+		term.line = TSCREEN();
+}
 
-	LIMIT(n, 0, term.bot-orig+1);
+void
+tringsync(int y1, int y2)
+{
+	Line *scr = TSCREEN();
+	int i;
 
-	if (copyhist) {
-		term.histi = (term.histi - 1 + HISTSIZE) % HISTSIZE;
-		temp = term.hist[term.histi];
-		term.hist[term.histi] = term.line[term.bot];
-		term.line[term.bot] = temp;
+	for (; y1 <= y2; y1++) {
+		i = term.org + term.nring - term.row + y1;
+		term.ring[i < term.nring ? i + term.nring : i - term.nring] = scr[y1];
 	}
+}
 
-	tsetdirt(orig, term.bot-n);
-	tclearregion(0, term.bot-n+1, term.col-1, term.bot);
-
-	for (i = term.bot; i >= orig+n; i--) {
-		temp = term.line[i];
+/*
+ * Makes room for more history, up to histsize rows or histmem rows if
+ * fewer: the ring doubles and the new rows, at its oldest end, are left
+ * empty.
+ */
+void
+tringgrow(void)
+{
+	Line *ring;
+	uchar **hist;
+	int i, cap = term.nring - term.row, ncap;
+
+	if (cap >= MIN(histsize, histmem))
+		return;
+	ncap = MIN(MAX(2 * cap, 64), MIN(histsize, histmem));
+	ring = xmalloc(2 * (ncap + term.row) * sizeof(Line));
+	memset(ring, 0, (ncap - cap) * sizeof(Line));
+	memcpy(ring + ncap - cap, term.ring + term.org,
+	       term.nring * sizeof(Line));
+	hist = xmalloc((ncap + term.row) * sizeof(*hist));
+	memset(hist, 0, (ncap - cap) * sizeof(*hist));
+	for (i = 0; i < term.nring; i++)
+		hist[ncap - cap + i] = term.hist[(term.org + i) % term.nring];
+	free(term.ring);
+	free(term.hist);
+	term.ring = ring;
+	term.hist = hist;
+	term.nring = ncap + term.row;
+	term.org = 0;
+	memcpy(ring + term.nring, ring, term.nring * sizeof(Line));
+	tringmove(0);
+}
+
+/*
+ * Moves the origin of the ring by a row, the first row of the main screen
+ * becoming the newest history row, and returns the row which comes out
+ * at the bottom of the main screen, in place of the oldest history row:
+ * the one thistpack() left over, or a new blank one. The oldest history
+ * row goes to the history file if the history goes on past the ring. The
+ * newest history row is still to be packed.
+ */
+Line
+tringnext(void)
+{
+	Line *scr;
+
+	if (term.nstore >= term.nring - term.row)
+		tringgrow();
+	tringmove(1);
+	scr = TSCREEN();
+	if (term.nstore < histsize &&
+	    (term.nstore < term.nring - term.row || histsize > histmem)) {
+		term.nstore++;
+		term.histn++;
+	} else if (term.nstore) {
+		thistdrop(1);
+		term.nstore++;
+		term.histn++;
+	}
+	if (term.nstore > term.nring - term.row)
+		thistspill(THIST(term.row - 1));
+	rowfree(THIST(term.row - 1));
+	THIST(term.row - 1) = NULL;
+	if (term.spare) {
+		scr[term.row - 1] = term.spare;
+		term.spare = NULL;
+	} else {
+		scr[term.row - 1] = linealloc(term.maxcol);
+		tblankline(scr[term.row - 1], term.maxcol);
+	}
+	tringsync(term.row - 1, term.row - 1);
+
+	return scr[term.row - 1];
+}
+
+/*
+ * Packs the newest history row, or drops its text if keep is 0, and
+ * keeps the row itself for the next tringnext().
+ */
+void
+thistpack(int keep)
+{
+	Line *scr = TSCREEN();
+
+	if (keep && histsize)
+		THIST(-1) = rowpack(scr[-1], term.col);
+	term.spare = scr[-1];
+	scr[-1] = NULL;
+	tringsync(-1, -1);
+	term.nhist++;
+}
+
+/*
+ * Returns the history row y, from -term.histn to -1, unpacked. Rows are
+ * unpacked into term.hline by their number modulo term.row, so that the
+ * rows of a screen, scrolled back as far as it goes, are unpacked once
+ * and stay there while in use. Rows stored before the last change of width
+ * are rewrapped to it here, as far back as they are read.
+ */
+Line
+thistline(int y)
+{
+	ulong n = term.nhist + y;
+	int i = n % term.row, v = -y - (term.nstore - rewrap.nrow);
+	Slice *sl;
+
+	if (!term.hline[i]) {
+		term.hline[i] = linealloc(term.maxcol);
+	} else if (term.htag[i] == n) {
+		return term.hline[i];
+	}
+	term.htag[i] = n;
+	if (v <= 0) {
+		rowunpack(term.hline[i], term.maxcol, thistrow(-y));
+		return term.hline[i];
+	}
+	thistwrap(-y);
+	if (v <= rewrap.n) {
+		sl = &rewrap.map[v - 1];
+		thistjoin(sl->row);
+		tflowrow(term.hline[i], sl->col, sl->col + sl->len, sl->wrap);
+	} else {
+		rowunpack(term.hline[i], term.maxcol, NULL);
+	}
+
+	return term.hline[i];
+}
+
+/* returns the stored history row s, 1 the newest, packed */
+const uchar *
+thistrow(int s)
+{
+	int cap = term.nring - term.row;
+
+	return s <= cap ? THIST(-s) : thistload(hfile.nrow - (s - cap));
+}
+
+/*
+ * Takes the newest stored history row out of the history, the ring moving
+ * back by a row, and returns it packed. The row of the main screen which
+ * goes out at the bottom is left to the caller, the row coming back at the
+ * top is NULL. Rows of the history file come back into the ring.
+ */
+uchar *
+thistpop(void)
+{
+	uchar *p = THIST(-1);
+	int cap = term.nring - term.row;
+
+	THIST(-1) = NULL;
+	tringmove(term.nring - 1);
+	TSCREEN()[-cap] = NULL;
+	tringsync(-cap, -cap);
+	term.nstore--;
+	term.histn--;
+	term.nhist--;
+	rewrap.nrow = MIN(rewrap.nrow, term.nstore);
+	if (term.nstore >= cap)
+		THIST(-cap) = thistunspill();
+
+	return p;
+}
+
+/*
+ * Forgets the n oldest stored history rows. If they were rewrapped, the
+ * rows of their logical line are rewrapped again once they are read.
+ */
+void
+thistdrop(int n)
+{
+	int i, r;
+
+	for (; n > 0; n--) {
+		term.nstore--;
+		if (rewrap.nrow && --rewrap.nrow < rewrap.ndone) {
+			r = rewrap.map[rewrap.n - 1].row;
+			while (rewrap.n && rewrap.map[rewrap.n - 1].row == r)
+				rewrap.n--;
+			rewrap.ndone = r;
+			rewrap.last = -1;
+			for (i = 0; i < term.row; i++)
+				term.htag[i] = ~0UL;
+		}
+	}
+	term.histn = term.nstore + rewrap.n - rewrap.ndone;
+	term.scr = MIN(term.scr, term.histn);
+}
+
+/*
+ * Rewraps the rows stored before the last change of width, a logical line
+ * at a time, until the history is rewrapped v rows back or all of it.
+ */
+void
+thistwrap(int v)
+{
+	int r0, r1, p, e, i, n;
+	uint ncell;
+
+	v -= term.nstore - rewrap.nrow;
+	while (v > rewrap.n && rewrap.ndone < rewrap.nrow) {
+		r0 = rewrap.ndone;
+		r1 = thistjoin(r0);
+		for (n = 0, p = 0; !n || p < rewrap.len; n++)
+			p = tflowcut(p, term.col);
+		if (rewrap.n + n > rewrap.cap) {
+			rewrap.cap = MAX(2 * rewrap.cap, rewrap.n + n);
+			rewrap.map = xrealloc(rewrap.map,
+			                      rewrap.cap * sizeof(*rewrap.map));
+		}
+		/* the newest row goes first */
+		for (i = rewrap.n + n, p = 0; i > rewrap.n; p = e) {
+			e = tflowcut(p, term.col);
+			rewrap.map[--i] = (Slice){ .row = r0, .col = p,
+			                           .len = e - p,
+			                           .wrap = e < rewrap.len };
+		}
+		rewrap.map[i].wrap = rowhead(thistrow(term.nstore -
+		                             rewrap.nrow + r0 + 1), &ncell);
+		rewrap.n += n;
+		rewrap.ndone = r1 + 1;
+	}
+	term.histn = term.nstore + rewrap.n - rewrap.ndone;
+}
+
+/*
+ * Puts together in rewrap.line the logical line which ends at the stored
+ * row r0, counted from the newest of the rows stored before the last
+ * change of width, and returns the row it starts at.
+ */
+int
+thistjoin(int r0)
+{
+	static Line row;
+	static int rowcol;
+	const uchar *p;
+	uint ncell;
+	int r, s = term.nstore - rewrap.nrow + 1;
+
+	if (rewrap.last == r0)
+		return rewrap.first;
+	for (r = r0; r + 1 < rewrap.nrow; r++) {
+		if (!rowhead(thistrow(s + r + 1), &ncell))
+			break;
+	}
+	rewrap.first = r;
+	rewrap.last = r0;
+	rewrap.len = 0;
+	for (; r >= r0; r--) {
+		p = thistrow(s + r);
+		rowhead(p, &ncell);
+		if (rowcol < ncell) {
+			free(row);
+			rowcol = ncell;
+			row = xmalloc(rowcol * sizeof(Glyph));
+		}
+		rowunpack(row, ncell, p);
+		tflowcat(row, ncell);
+	}
+
+	return rewrap.first;
+}
+
+/*
+ * Appends the n cells of a row to the logical line in rewrap.line, less
+ * ATTR_WRAP, dropping the blank a wide char wrapped early left behind.
+ */
+void
+tflowcat(const Glyph *row, int n)
+{
+	Glyph *gp;
+	int i;
+
+	if (n <= 0)
+		return;
+	if (rewrap.len + n > rewrap.size) {
+		rewrap.size = MAX(2 * rewrap.size, rewrap.len + n);
+		rewrap.line = xrealloc(rewrap.line,
+		                       rewrap.size * sizeof(Glyph));
+	}
+	if (rewrap.len > 0 && (row[0].mode & ATTR_WIDE) &&
+	    ISBLANK(rewrap.line[rewrap.len - 1]))
+		rewrap.len--;
+	gp = rewrap.line + rewrap.len;
+	memcpy(gp, row, n * sizeof(Glyph));
+	for (i = 0; i < n; i++)
+		gp[i].mode &= ~ATTR_WRAP;
+	rewrap.len += n;
+}
+
+/*
+ * Returns where the row of at most w cells which starts at the cell p of
+ * rewrap.line ends: a wide char which does not fit goes to the next row.
+ */
+int
+tflowcut(int p, int w)
+{
+	int e = MIN(p + w, rewrap.len);
+
+	if (e < rewrap.len && e - p > 1 &&
+	    (rewrap.line[e - 1].mode & ATTR_WIDE))
+		e--;
+
+	return e;
+}
+
+/*
+ * Fills line with the cells p to e-1 of rewrap.line followed by blanks,
+ * with ATTR_WRAP in the last column if the logical line goes on.
+ */
+void
+tflowrow(Line line, int p, int e, int wrap)
+{
+	int x;
+
+	memcpy(line, rewrap.line + p, (e - p) * sizeof(Glyph));
+	for (x = e - p; x < term.maxcol; x++)
+		line[x] = (Glyph){ .u = ' ', .fg = defaultfg, .bg = defaultbg };
+	if (wrap)
+		line[term.col - 1].mode |= ATTR_WRAP;
+}
+
+/*
+ * Rewraps the logical lines of the main screen, written ocol columns wide,
+ * to the width of the terminal. Rows which no longer fit above the cursor
+ * go into the history. A logical line which the history ends with, and
+ * which goes on on the screen, comes back to it to be rewrapped, up to a
+ * screenful of its rows. The history itself is rewrapped as it is read.
+ */
+void
+treflow(int ocol)
+{
+	TCursor *c = IS_SET(MODE_ALTSCREEN) ? &csave[0] : &term.c;
+	uchar **pulled;
+	Line *scr, *src, *out = NULL, line = NULL;
+	int i, y, k, n, wrap, last, off = -1, p, e, push;
+	int nout = 0, outcap = 0, cx = 0, cy = 0, linecol = 0;
+	uint ncell;
+
+	selclear();
+	term.scr = 0;
+	rewrap.nrow = term.nstore;
+	rewrap.ndone = rewrap.n = 0;
+	rewrap.last = -1;
+	term.histn = term.nstore;
+
+	scr = TSCREEN();
+	src = xmalloc(term.row * sizeof(Line));
+	memcpy(src, scr, term.row * sizeof(Line));
+	for (k = 0; k < term.row && k < term.nstore; k++) {
+		if (!rowhead(thistrow(k + 1), &ncell))
+			break;
+	}
+	pulled = xmalloc(MAX(k, 1) * sizeof(*pulled));
+	for (i = k - 1; i >= 0; i--)
+		pulled[i] = thistpop();
+
+	c->y = MIN(c->y, term.row - 1);
+	c->x = MIN(c->x, ocol - 1);
+	for (last = term.row - 1; last > c->y; last--) {
+		if (rowlen(src[last], ocol) > 0)
+			break;
+	}
+
+	/* the pulled rows, then the screen, a logical line at a time */
+	rewrap.len = 0;
+	for (i = 0; i < k + last + 1; i++) {
+		if (i < k) {
+			wrap = rowhead(pulled[i], &ncell);
+			if (linecol < ncell) {
+				free(line);
+				linecol = ncell;
+				line = xmalloc(linecol * sizeof(Glyph));
+			}
+			rowunpack(line, ncell, pulled[i]);
+			tflowcat(line, ncell);
+			rowfree(pulled[i]);
+		} else {
+			y = i - k;
+			n = rowlen(src[y], ocol);
+			wrap = (src[y][ocol - 1].mode & ATTR_WRAP) != 0;
+			tflowcat(src[y], n);
+			if (y == c->y) {
+				off = rewrap.len - n + c->x;
+				while (rewrap.len <= off) {
+					tflowcat(&(Glyph){ .u = ' ',
+					         .fg = defaultfg,
+					         .bg = defaultbg }, 1);
+				}
+			}
+		}
+		if (wrap && i < k + last)
+			continue;
+
+		for (p = 0; p == 0 || p < rewrap.len; p = e) {
+			e = tflowcut(p, term.col);
+			if (nout == outcap) {
+				outcap = MAX(2 * outcap, 2 * term.row);
+				out = xrealloc(out, outcap * sizeof(Line));
+			}
+			out[nout] = linealloc(term.maxcol);
+			tflowrow(out[nout], p, e, e < rewrap.len);
+			if (p <= off && off < e) {
+				cy = nout;
+				cx = off - p;
+			}
+			nout++;
+			if (e == p)
+				break;
+		}
+		rewrap.len = 0;
+		off = -1;
+	}
+	free(line);
+	free(pulled);
+	for (y = 0; y < term.row; y++)
+		linefree(src[y]);
+	free(src);
+
+	/* rows which do not fit above the cursor go into the history */
+	push = MAX(0, MIN(nout - term.row, cy));
+	memset(scr = TSCREEN(), 0, term.row * sizeof(Line));
+	tringsync(0, term.row - 1);
+	for (i = 0; i < push; i++) {
+		scr = TSCREEN();
+		linefree(scr[0]);
+		scr[0] = out[i];
+		tringsync(0, 0);
+		tringnext();
+		thistpack(1);
+	}
+	scr = TSCREEN();
+	for (y = 0; y < term.row; y++) {
+		linefree(scr[y]);
+		if (push + y < nout) {
+			scr[y] = out[push + y];
+		} else {
+			scr[y] = linealloc(term.maxcol);
+			tblankline(scr[y], term.maxcol);
+		}
+	}
+	tringsync(0, term.row - 1);
+	for (i = push + term.row; i < nout; i++)
+		linefree(out[i]);
+	free(out);
+	rewrap.last = -1;
+
+	c->x = cx;
+	c->y = cy - push;
+	if (c->state & CURSOR_WRAPNEXT && cx < term.col - 1) {
+		c->x++;
+		c->state &= ~CURSOR_WRAPNEXT;
+	}
+	tfulldirt();
+}
+
+/*
+ * Appends the packed row p, which leaves the ring, to the history file
+ * and forgets the segments of the file all older than the history. The
+ * history keeps to the ring if the file cannot be written.
+ */
+void
+thistspill(const uchar *p)
+{
+	size_t n = p ? rowunpack(NULL, 0, p) - p : 0;
+	ulong live;
+	uint32_t end;
+	int r = hfile.nrow % HIST_SEG_ROWS, i;
+
+	if (!thistmap(n + (r ? 0 : HIST_SEG_HDR))) {
+		thistclose();
+		histsize = histmem;
+		thistdrop(term.nstore - (term.nring - term.row));
+		selclear();
+		tfulldirt();
+		return;
+	}
+	if (!r) {
+		if (hfile.nseg == hfile.segcap) {
+			hfile.segcap = MAX(2 * hfile.segcap, 64);
+			hfile.seg = xrealloc(hfile.seg,
+			                     hfile.segcap * sizeof(*hfile.seg));
+		}
+		hfile.seg[hfile.nseg++] = hfile.len;
+		hfile.len += HIST_SEG_HDR;
+	}
+	if (n)
+		memcpy(hfile.map + hfile.len, p, n);
+	hfile.len += n;
+	end = hfile.len - hfile.seg[hfile.nseg - 1] - HIST_SEG_HDR;
+	memcpy(hfile.map + hfile.seg[hfile.nseg - 1] + r * sizeof(end), &end,
+	       sizeof(end));
+	hfile.nrow++;
+
+	live = term.nstore - (term.nring - term.row);
+	while (hfile.dead < hfile.nseg && hfile.first + (hfile.dead + 1) *
+	       HIST_SEG_ROWS <= hfile.nrow - live)
+		hfile.dead++;
+	if (!hfile.dead || (hfile.dead < hfile.nseg &&
+	    hfile.seg[hfile.dead] < hfile.len / 2))
+		return;
+
+	/* most of the file is dead, move what is left to its start */
+	n = hfile.dead < hfile.nseg ? hfile.seg[hfile.dead] : hfile.len;
+	memmove(hfile.map, hfile.map + n, hfile.len - n);
+	hfile.len -= n;
+	for (i = hfile.dead; i < hfile.nseg; i++)
+		hfile.seg[i - hfile.dead] = hfile.seg[i] - n;
+	hfile.nseg -= hfile.dead;
+	hfile.first += (ulong)hfile.dead * HIST_SEG_ROWS;
+	hfile.dead = 0;
+}
+
+/* takes the newest row of the history file back out of it */
+uchar *
+thistunspill(void)
+{
+	const uchar *p = thistload(hfile.nrow - 1);
+	uchar *row = NULL;
+	size_t n;
+
+	if (p) {
+		n = rowunpack(NULL, 0, p) - p;
+		row = rowalloc(n);
+		memcpy(row, p, n);
+	}
+	hfile.nrow--;
+	if (hfile.nrow % HIST_SEG_ROWS == 0)
+		hfile.len = hfile.seg[--hfile.nseg];
+	else
+		hfile.len = p ? p - hfile.map : hfile.len;
+
+	return row;
+}
+
+/* returns the row n of the history file, packed, NULL a blank row */
+const uchar *
+thistload(ulong n)
+{
+	uchar *seg = hfile.map + hfile.seg[(n - hfile.first) / HIST_SEG_ROWS];
+	uint32_t start = 0, end;
+	int r = (n - hfile.first) % HIST_SEG_ROWS;
+
+	if (r)
+		memcpy(&start, seg + (r - 1) * sizeof(start), sizeof(start));
+	memcpy(&end, seg + r * sizeof(end), sizeof(end));
+
+	return end > start ? seg + HIST_SEG_HDR + start : NULL;
+}
+
+/*
+ * Makes room for n more bytes in the history file, created on first use
+ * in $TMPDIR and removed at once, so that it goes away with st however it
+ * exits. The room is allocated before it is mapped, a full disk is an
+ * error here rather than a SIGBUS later. Returns 0 on error.
+ */
+int
+thistmap(size_t n)
+{
+	char path[PATH_MAX];
+	const char *dir;
+	size_t size;
+	int err;
+
+	if (hfile.len + n <= hfile.size)
+		return 1;
+	if (hfile.fd < 0) {
+		if (!(dir = getenv("TMPDIR")) || !*dir)
+			dir = "/tmp";
+		snprintf(path, sizeof(path), "%s/st-hist.XXXXXX", dir);
+		if ((hfile.fd = mkstemp(path)) < 0) {
+			fprintf(stderr, "mkstemp %s: %s\n", path,
+			        strerror(errno));
+			return 0;
+		}
+		unlink(path);
+		fcntl(hfile.fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	size = MAX(MAX(2 * hfile.size, hfile.len + n), HIST_FILE_MIN);
+	if ((err = posix_fallocate(hfile.fd, 0, size))) {
+		fprintf(stderr, "history file: %s\n", strerror(err));
+		return 0;
+	}
+	if (hfile.map)
+		munmap(hfile.map, hfile.size);
+	hfile.map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                 hfile.fd, 0);
+	if (hfile.map == MAP_FAILED) {
+		fprintf(stderr, "mmap history file: %s\n", strerror(errno));
+		hfile.map = NULL;
+		return 0;
+	}
+	hfile.size = size;
+
+	return 1;
+}
+
+void
+thistclose(void)
+{
+	if (hfile.map)
+		munmap(hfile.map, hfile.size);
+	if (hfile.fd >= 0)
+		close(hfile.fd);
+	free(hfile.seg);
+	memset(&hfile, 0, sizeof(hfile));
+	hfile.fd = -1;
+}
+
+/*
+ * Returns n bytes for a packed row. Rows mostly leave the history in the
+ * order they came in, so a chunk is freed soon after it is filled.
+ */
+uchar *
+rowalloc(size_t n)
+{
+	void *p;
+	int err;
+
+	if (!rchunk || rchunk->len + n > ROW_CHUNK) {
+		if (rchunk && !rchunk->nrow)
+			free(rchunk);
+		if ((err = posix_memalign(&p, ROW_CHUNK,
+		                          MAX(ROW_CHUNK, sizeof(RowChunk) + n))))
+			die("posix_memalign: %s\n", strerror(err));
+		rchunk = p;
+		rchunk->len = sizeof(RowChunk);
+		rchunk->nrow = 0;
+	}
+	p = (uchar *)rchunk + rchunk->len;
+	rchunk->len += n;
+	rchunk->nrow++;
+
+	return p;
+}
+
+/* gives back a row of rowalloc(), its chunk too if it was the last one */
+void
+rowfree(uchar *p)
+{
+	RowChunk *c;
+
+	if (!p)
+		return;
+	c = (RowChunk *)((uintptr_t)p & ~(uintptr_t)(ROW_CHUNK - 1));
+	if (--c->nrow > 0)
+		return;
+	if (c == rchunk)
+		c->len = sizeof(RowChunk);
+	else
+		free(c);
+}
+
+/*
+ * A packed row is the number of its cells, times two plus one if the row
+ * wraps, followed by runs of cells: a byte of RUN_* flags, the number of
+ * cells, their mode, fg and bg when these change, and their runes in UTF-8,
+ * once only for a repeated cell. The second cell of a wide char is not kept
+ * when it is the usual dummy, nor are the blanks a row which does not wrap
+ * ends with. Counts are 7 bits a byte, low bits first.
+ */
+uchar *
+packnum(uchar *p, uint n)
+{
+	for (; n >= 0x80; n >>= 7)
+		*p++ = n | 0x80;
+	*p++ = n;
+
+	return p;
+}
+
+const uchar *
+unpacknum(const uchar *p, uint *n)
+{
+	int shift;
+
+	for (*n = 0, shift = 0; *p & 0x80; shift += 7)
+		*n |= (*p++ & 0x7F) << shift;
+	*n |= *p++ << shift;
+
+	return p;
+}
+
+uchar *
+packrun(uchar *p, int flags, const Glyph *attr, Glyph *prev, int n)
+{
+	if (attr->mode != prev->mode || attr->fg != prev->fg ||
+	    attr->bg != prev->bg) {
+		flags |= RUN_ATTR;
+		*prev = *attr;
+	}
+	*p++ = flags;
+	p = packnum(p, n);
+	if (flags & RUN_ATTR) {
+		memcpy(p, &attr->mode, sizeof(attr->mode));
+		p += sizeof(attr->mode);
+		memcpy(p, &attr->fg, sizeof(attr->fg));
+		p += sizeof(attr->fg);
+		memcpy(p, &attr->bg, sizeof(attr->bg));
+		p += sizeof(attr->bg);
+	}
+
+	return p;
+}
+
+/* returns how many cells from line[i] on are the same as it */
+int
+packrepeat(const Glyph *line, int i, int n)
+{
+	int j;
+
+	for (j = i + 1; j < n && GLYPHEQ(line[j], line[i]); j++)
+		;
+
+	return j - i;
+}
+
+/* packs the cells line[i] to line[j - 1] as a run, not a repeated one */
+uchar *
+packcells(uchar *p, const Glyph *line, int i, int j, int wide, Glyph *prev)
+{
+	Glyph attr = line[i];
+	int flags = 0, k;
+
+	attr.mode &= ~ATTR_WRAP;
+	if (wide)
+		flags |= RUN_WIDE;
+	if (line[j - 1].mode & ATTR_WRAP)
+		flags |= RUN_WRAP;
+	p = packrun(p, flags, &attr, prev, (j - i) / (1 + wide));
+	for (k = i; k < j; k += 1 + wide) {
+		if (line[k].u < 0x80)
+			*p++ = line[k].u;
+		else
+			p += utf8encode(line[k].u, (char *)p);
+	}
+
+	return p;
+}
+
+uchar *
+rowpack(const Glyph *line, int n)
+{
+	static uchar *buf;
+	static int bufcol;
+	Glyph prev = { .fg = defaultfg, .bg = defaultbg };
+	uchar *p, *packed;
+	int i, j, wide, wrap;
+	ushort mode;
+	uint32_t fg, bg;
+
+	/* a run of 18 bytes at most for each cell */
+	if (bufcol < n) {
+		free(buf);
+		bufcol = n;
+		buf = xmalloc(n * 18 + 3);
+	}
+	wrap = (line[n - 1].mode & ATTR_WRAP) != 0;
+	n = rowlen(line, n);
+	p = packnum(buf, n << 1 | wrap);
+
+	for (i = 0; i < n; i = j) {
+		if ((j = i + packrepeat(line, i, n)) - i >= RUN_MIN_REPEAT) {
+			p = packrun(p, RUN_REPEAT, &line[i], &prev, j - i);
+			p += utf8encode(line[i].u, (char *)p);
+			continue;
+		}
+
+		/*
+		 * cells alike up to the next repeat: same attributes, all
+		 * wide chars with their dummy or none, the last one only
+		 * with ATTR_WRAP
+		 */
+		mode = line[i].mode & ~ATTR_WRAP;
+		fg = line[i].fg;
+		bg = line[i].bg;
+		wide = ISWIDEPAIR(line, i, n);
+		for (j = i; j < n; j += 1 + wide) {
+			if ((line[j].mode & ~ATTR_WRAP) != mode ||
+			    line[j].fg != fg || line[j].bg != bg)
+				break;
+			if ((mode & ATTR_WIDE) && ISWIDEPAIR(line, j, n) != wide)
+				break;
+			if (j + 1 < n && line[j + 1].u == line[j].u &&
+			    packrepeat(line, j, n) >= RUN_MIN_REPEAT)
+				break;
+			if (line[j + wide].mode & ATTR_WRAP) {
+				j += 1 + wide;
+				break;
+			}
+		}
+		p = packcells(p, line, i, j, wide, &prev);
+	}
+
+	packed = rowalloc(p - buf);
+	memcpy(packed, buf, p - buf);
+
+	return packed;
+}
+
+/* returns if the packed row p wraps, and its number of cells in ncell */
+int
+rowhead(const uchar *p, uint *ncell)
+{
+	uint n = 0;
+
+	if (p)
+		unpacknum(p, &n);
+	*ncell = n >> 1;
+
+	return n & 1;
+}
+
+/*
+ * Returns how many of the n cells of a row are part of its logical line:
+ * all of them if it wraps, else up to the last one not blank.
+ */
+int
+rowlen(const Glyph *line, int n)
+{
+	if (line[n - 1].mode & ATTR_WRAP)
+		return n;
+	while (n > 0 && ISBLANK(line[n - 1]))
+		n--;
+
+	return n;
+}
+
+/*
+ * Unpacks a row packed by rowpack() into n cells, NULL a blank row, and
+ * returns the end of it.
+ */
+const uchar *
+rowunpack(Line line, int n, const uchar *p)
+{
+	Glyph attr = { .fg = defaultfg, .bg = defaultbg };
+	uint ncell, cnt, i;
+	int x = 0, flags;
+	Rune u;
+
+	if (p) {
+		p = unpacknum(p, &ncell);
+		ncell >>= 1;
+		while (x < ncell) {
+			flags = *p++;
+			p = unpacknum(p, &cnt);
+			if (flags & RUN_ATTR) {
+				memcpy(&attr.mode, p, sizeof(attr.mode));
+				p += sizeof(attr.mode);
+				memcpy(&attr.fg, p, sizeof(attr.fg));
+				p += sizeof(attr.fg);
+				memcpy(&attr.bg, p, sizeof(attr.bg));
+				p += sizeof(attr.bg);
+			}
+			if (flags & RUN_REPEAT) {
+				p += utf8decode((const char *)p, &attr.u, UTF_SIZ);
+				for (i = 0; i < cnt; i++, x++) {
+					if (x < n)
+						line[x] = attr;
+				}
+				continue;
+			}
+			for (i = 0; i < cnt; i++) {
+				p += utf8decode((const char *)p, &u, UTF_SIZ);
+				if (x < n) {
+					line[x] = attr;
+					line[x].u = u;
+				}
+				x++;
+				if ((flags & RUN_WIDE) && x < n) {
+					line[x] = attr;
+					line[x].u = 0;
+					line[x].mode = ATTR_WDUMMY;
+				}
+				x += (flags & RUN_WIDE) != 0;
+			}
+			if ((flags & RUN_WRAP) && x <= n)
+				line[x - 1].mode |= ATTR_WRAP;
+		}
+	}
+	for (; x < n; x++)
+		line[x] = (Glyph){ .u = ' ', .fg = defaultfg, .bg = defaultbg };
+
+	return p;
+}
+
+/* rotates the rows y1 to y2 of lines by one, down or else up */
+void
+trotate(Line *lines, int y1, int y2, int down)
+{
+	Line temp;
+
+	if (y1 >= y2)
+		return;
+	if (down) {
+		temp = lines[y2];
+		memmove(&lines[y1 + 1], &lines[y1], (y2 - y1) * sizeof(Line));
+		lines[y1] = temp;
+	} else {
+		temp = lines[y1];
+		memmove(&lines[y1], &lines[y1 + 1], (y2 - y1) * sizeof(Line));
+		lines[y2] = temp;
+	}
+}
+
+/*
+ * Returns a row of ncol cells, ncol being term.maxcol but while tresize()
+ * widens the screens: the free rows of the old width are dropped then, and
+ * its slabs freed as their last rows are.
+ */
+Line
+linealloc(int ncol)
+{
+	LineSlab *s, *next;
+	Line line;
+
+	if (ncol != lpool.ncol) {
+		for (s = lpool.slab; s; s = next) {
+			next = s->next;
+			if (s->nrow)
+				s->old = 1;
+			else
+				free(s);
+		}
+		lpool.slab = NULL;
+		lpool.free = NULL;
+		lpool.ncol = ncol;
+	}
+	if ((line = lpool.free)) {
+		memcpy(&lpool.free, line, sizeof(Line));
+		s = lineslab(line);
+	} else {
+		if (!(s = lpool.slab) || s->nused == LINE_SLAB) {
+			s = xmalloc(sizeof(*s) +
+			            LINE_SLAB * (ncol + 1) * sizeof(Glyph));
+			s->next = lpool.slab;
+			s->ncol = ncol;
+			s->nused = s->nrow = s->old = 0;
+			lpool.slab = s;
+		}
+		line = (Glyph *)(s + 1) + s->nused++ * (ncol + 1) + 1;
+		memcpy(&line[-1], &s, sizeof(s));
+	}
+	s->nrow++;
+
+	return line;
+}
+
+/* returns line, moved to a row of ncol cells if it is narrower */
+Line
+linerealloc(Line line, int ncol)
+{
+	LineSlab *s = lineslab(line);
+	Line new;
+
+	if (s->ncol >= ncol)
+		return line;
+	new = linealloc(ncol);
+	memcpy(new, line, s->ncol * sizeof(Glyph));
+	linefree(line);
+
+	return new;
+}
+
+/*
+ * Gives a row back to its slab. A slab with no row in use is freed, its
+ * rows taken off the free list, unless it is the one rows are carved out
+ * of.
+ */
+void
+linefree(Line line)
+{
+	LineSlab *s, **sp;
+	Line l, prev, next;
+
+	if (!line)
+		return;
+	s = lineslab(line);
+	if (s->old) {
+		if (--s->nrow == 0)
+			free(s);
+		return;
+	}
+	memcpy(line, &lpool.free, sizeof(Line));
+	lpool.free = line;
+	if (--s->nrow > 0 || s == lpool.slab)
+		return;
+	for (prev = NULL, l = lpool.free; l; l = next) {
+		memcpy(&next, l, sizeof(Line));
+		if (lineslab(l) != s)
+			prev = l;
+		else if (prev)
+			memcpy(prev, &next, sizeof(Line));
+		else
+			lpool.free = next;
+	}
+	for (sp = &lpool.slab; *sp != s; sp = &(*sp)->next)
+		;
+	*sp = s->next;
+	free(s);
+}
+
+LineSlab *
+lineslab(const Line line)
+{
+	LineSlab *s;
+
+	memcpy(&s, &line[-1], sizeof(s));
+
+	return s;
+}
+
+/* blanks n cells as tclearregion() does, regardless of the selection */
+void
+tblankline(Line line, int n)
+{
+	Glyph *gp;
+
+	for (gp = line; gp < &line[n]; gp++) {
+		gp->fg = term.c.attr.fg;
+		gp->bg = term.c.attr.bg;
+		gp->mode = 0;
+		gp->u = ' ';
+	}
+}
+
+/*
+ * Moves the row at orig into the history and scrolls the rows below it
+ * up to term.bot, where the oldest row of the history comes back blank.
+ * The history grows by moving the origin of the ring, so only the rows
+ * of the main screen outside of orig to term.bot are moved back, none
+ * when scrolling the whole of it.
+ */
+void
+thistpush(int orig)
+{
+	Line *scr, temp;
+
+	tringnext();
+	scr = TSCREEN();
+	if (IS_SET(MODE_ALTSCREEN)) {
+		trotate(scr, -1, term.row - 1, 1);
+		temp = scr[-1];
+		scr[-1] = term.line[orig];
+		term.line[orig] = temp;
+		tringsync(-1, term.row - 1);
+		trotate(term.line, orig, term.bot, 0);
+	} else {
+		trotate(scr, -1, orig - 1, 1);
+		trotate(scr, term.bot, term.row - 1, 1);
+		tringsync(-1, orig - 1);
+		tringsync(term.bot, term.row - 1);
+	}
+	thistpack(1);
+	tblankline(term.line[term.bot], term.col);
+	tsetdirt(orig, term.bot);
+}
+
+void
+tscrolldown(int orig, int n)
+{
+	int i;
+	Line temp;
+
+	LIMIT(n, 0, term.bot-orig+1);
+
+	tsetdirt(orig, term.bot-n);
+	tclearregion(0, term.bot-n+1, term.col-1, term.bot);
+
+	for (i = term.bot; i >= orig+n; i--) {
+		temp = term.line[i];
 		term.line[i] = term.line[i-n];
 		term.line[i-n] = temp;
 	}
+	if (!IS_SET(MODE_ALTSCREEN))
+		tringsync(orig, term.bot);
 
 	if (term.scr == 0)
 		selscroll(orig, n);
@@ -1146,28 +2961,38 @@ tscrolldown(int orig, int n, int copyhist)
 void
 tscrollup(int orig, int n, int copyhist)
 {
-	int i;
+	int i, m;
 	Line temp;
 
 	LIMIT(n, 0, term.bot-orig+1);
 
-	if (copyhist) {
-		term.histi = (term.histi + 1) % HISTSIZE;
-		temp = term.hist[term.histi];
-		term.hist[term.histi] = term.line[orig];
-		term.line[orig] = temp;
+	/* the first row is not cleared but taken by the history */
+	m = n;
+	if (copyhist && n > 0) {
+		for (i = 0; sel.ob.x != -1 && i < term.col; i++) {
+			if (selected(i, orig)) {
+				selclear();
+				break;
+			}
+		}
+		thistpush(orig);
+		m--;
 	}
 
-	if (term.scr > 0 && term.scr < HISTSIZE)
-		term.scr = MIN(term.scr + n, HISTSIZE-1);
+	if (term.scr > 0)
+		term.scr = MIN(term.scr + n, term.histn);
 
-	tclearregion(0, orig, term.col-1, orig+n-1);
-	tsetdirt(orig+n, term.bot);
+	if (m > 0) {
+		tclearregion(0, orig, term.col-1, orig+m-1);
+		tsetdirt(orig+m, term.bot);
 
-	for (i = orig; i <= term.bot-n; i++) {
-		temp = term.line[i];
-		term.line[i] = term.line[i+n];
-		term.line[i+n] = temp;
+		for (i = orig; i <= term.bot-m; i++) {
+			temp = term.line[i];
+			term.line[i] = term.line[i+m];
+			term.line[i+m] = temp;
+		}
+		if (!IS_SET(MODE_ALTSCREEN))
+			tringsync(orig, term.bot);
 	}
 
 	if (term.scr == 0)
@@ -1207,34 +3032,35 @@ tnewline(int first_col)
 	tmoveto(first_col ? 0 : term.c.x, y);
 }
 
+/*
+ * Parameters are accumulated as the bytes of the sequence arrive, so
+ * the final byte can be handled without another pass over the buffer.
+ * While parsing, narg is the index of the argument being read.
+ */
 void
-csiparse(void)
+csiparse(uchar c)
 {
-	char *p = csiescseq.buf, *np;
-	long int v;
+	int *v, d;
 
-	csiescseq.narg = 0;
-	if (*p == '?') {
+	if (csiescseq.mode[0]) {
+		if (!csiescseq.mode[1])
+			csiescseq.mode[1] = c;
+		return;
+	}
+
+	if (BETWEEN(c, '0', '9')) {
+		v = &csiescseq.arg[csiescseq.narg];
+		d = c - '0';
+		if (*v >= 0)
+			*v = (*v > (INT_MAX - d) / 10) ? -1 : *v * 10 + d;
+	} else if (c == '?' && csiescseq.len == 1) {
 		csiescseq.priv = 1;
-		p++;
-	}
-
-	csiescseq.buf[csiescseq.len] = '\0';
-	while (p < csiescseq.buf+csiescseq.len) {
-		np = NULL;
-		v = strtol(p, &np, 10);
-		if (np == p)
-			v = 0;
-		if (v == LONG_MAX || v == LONG_MIN)
-			v = -1;
-		csiescseq.arg[csiescseq.narg++] = v;
-		p = np;
-		if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ)
-			break;
-		p++;
+	} else if ((c == ';' || c == ':') && csiescseq.narg < ESC_ARG_SIZ-1) {
+		csiescseq.sub[++csiescseq.narg] = (c == ':');
+	} else {
+		csiescseq.narg++;
+		csiescseq.mode[0] = c;
 	}
-	csiescseq.mode[0] = *p++;
-	csiescseq.mode[1] = (p < csiescseq.buf+csiescseq.len) ? *p : '\0';
 }
 
 /* for absolute user moves, when decom is set */
@@ -1368,7 +3194,7 @@ void
 tinsertblankline(int n)
 {
 	if (BETWEEN(term.c.y, term.top, term.bot))
-		tscrolldown(term.c.y, n, 0);
+		tscrolldown(term.c.y, n);
 }
 
 void
@@ -1379,23 +3205,34 @@ tdeleteline(int n)
 }
 
 int32_t
-tdefcolor(const int *attr, int *npar, int l)
+tdefcolor(const int *attr, const char *sub, int *npar, int l)
 {
 	int32_t idx = -1;
 	uint r, g, b;
+	int p, colon;
+
+	/* ISO 8613-6 form: 38:2:[<colorspace>]:r:g:b, 38:5:n */
+	if ((colon = *npar + 1 < l && sub[*npar + 1])) {
+		for (p = *npar + 1; p < l && sub[p]; p++)
+			;
+		l = p;
+	}
 
 	switch (attr[*npar + 1]) {
 	case 2: /* direct color in RGB space */
-		if (*npar + 4 >= l) {
+		p = *npar + 2;
+		if (colon && l - *npar == 6)
+			p++; /* skip the colorspace id */
+		if (p + 2 >= l) {
 			fprintf(stderr,
 				"erresc(38): Incorrect number of parameters (%d)\n",
 				*npar);
 			break;
 		}
-		r = attr[*npar + 2];
-		g = attr[*npar + 3];
-		b = attr[*npar + 4];
-		*npar += 4;
+		r = attr[p];
+		g = attr[p + 1];
+		b = attr[p + 2];
+		*npar = p + 2;
 		if (!BETWEEN(r, 0, 255) || !BETWEEN(g, 0, 255) || !BETWEEN(b, 0, 255))
 			fprintf(stderr, "erresc: bad rgb color (%u,%u,%u)\n",
 				r, g, b);
@@ -1424,21 +3261,30 @@ tdefcolor(const int *attr, int *npar, int l)
 		        "erresc(38): gfx attr %d unknown\n", attr[*npar]);
 		break;
 	}
+	if (colon)
+		*npar = l - 1;
 
 	return idx;
 }
 
-void
-tsetattr(const int *attr, int l)
+/*
+ * Folds the attributes of an SGR sequence into one change of the cursor
+ * attributes. Returns 0 if any of them could not be understood.
+ */
+int
+tsgrdelta(SGRDelta *d, const int *attr, const char *sub, int l)
 {
-	int i;
+	int i, ok = 1;
 	int32_t idx;
 
+#define ATTRSET(m)	(d->set |= (m))
+#define ATTRCLR(m)	(d->clr |= (m), d->set &= ~(m))
+	d->set = d->clr = 0;
+	d->fg = d->bg = COL_KEEP;
 	for (i = 0; i < l; i++) {
 		switch (attr[i]) {
 		case 0:
-			term.c.attr.mode &= ~(
-				ATTR_BOLD       |
+			ATTRCLR(ATTR_BOLD       |
 				ATTR_FAINT      |
 				ATTR_ITALIC     |
 				ATTR_UNDERLINE  |
@@ -1446,88 +3292,113 @@ tsetattr(const int *attr, int l)
 				ATTR_REVERSE    |
 				ATTR_INVISIBLE  |
 				ATTR_STRUCK     );
-			term.c.attr.fg = defaultfg;
-			term.c.attr.bg = defaultbg;
+			d->fg = d->bg = COL_DEFAULT;
 			break;
 		case 1:
-			term.c.attr.mode |= ATTR_BOLD;
+			ATTRSET(ATTR_BOLD);
 			break;
 		case 2:
-			term.c.attr.mode |= ATTR_FAINT;
+			ATTRSET(ATTR_FAINT);
 			break;
 		case 3:
-			term.c.attr.mode |= ATTR_ITALIC;
+			ATTRSET(ATTR_ITALIC);
 			break;
 		case 4:
-			term.c.attr.mode |= ATTR_UNDERLINE;
+			/* 4:0 turns underline off, other styles are drawn plain */
+			if (i + 1 < l && sub[i + 1] && attr[i + 1] == 0)
+				ATTRCLR(ATTR_UNDERLINE);
+			else
+				ATTRSET(ATTR_UNDERLINE);
 			break;
 		case 5: /* slow blink */
 			/* FALLTHROUGH */
 		case 6: /* rapid blink */
-			term.c.attr.mode |= ATTR_BLINK;
+			ATTRSET(ATTR_BLINK);
 			break;
 		case 7:
-			term.c.attr.mode |= ATTR_REVERSE;
+			ATTRSET(ATTR_REVERSE);
 			break;
 		case 8:
-			term.c.attr.mode |= ATTR_INVISIBLE;
+			ATTRSET(ATTR_INVISIBLE);
 			break;
 		case 9:
-			term.c.attr.mode |= ATTR_STRUCK;
+			ATTRSET(ATTR_STRUCK);
 			break;
 		case 22:
-			term.c.attr.mode &= ~(ATTR_BOLD | ATTR_FAINT);
+			ATTRCLR(ATTR_BOLD | ATTR_FAINT);
 			break;
 		case 23:
-			term.c.attr.mode &= ~ATTR_ITALIC;
+			ATTRCLR(ATTR_ITALIC);
 			break;
 		case 24:
-			term.c.attr.mode &= ~ATTR_UNDERLINE;
+			ATTRCLR(ATTR_UNDERLINE);
 			break;
 		case 25:
-			term.c.attr.mode &= ~ATTR_BLINK;
+			ATTRCLR(ATTR_BLINK);
 			break;
 		case 27:
-			term.c.attr.mode &= ~ATTR_REVERSE;
+			ATTRCLR(ATTR_REVERSE);
 			break;
 		case 28:
-			term.c.attr.mode &= ~ATTR_INVISIBLE;
+			ATTRCLR(ATTR_INVISIBLE);
 			break;
 		case 29:
-			term.c.attr.mode &= ~ATTR_STRUCK;
+			ATTRCLR(ATTR_STRUCK);
 			break;
 		case 38:
-			if ((idx = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.fg = idx;
+			if ((idx = tdefcolor(attr, sub, &i, l)) >= 0)
+				d->fg = idx;
+			else
+				ok = 0;
 			break;
 		case 39:
-			term.c.attr.fg = defaultfg;
+			d->fg = COL_DEFAULT;
 			break;
 		case 48:
-			if ((idx = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.bg = idx;
+			if ((idx = tdefcolor(attr, sub, &i, l)) >= 0)
+				d->bg = idx;
+			else
+				ok = 0;
 			break;
 		case 49:
-			term.c.attr.bg = defaultbg;
+			d->bg = COL_DEFAULT;
 			break;
 		default:
 			if (BETWEEN(attr[i], 30, 37)) {
-				term.c.attr.fg = attr[i] - 30;
+				d->fg = attr[i] - 30;
 			} else if (BETWEEN(attr[i], 40, 47)) {
-				term.c.attr.bg = attr[i] - 40;
+				d->bg = attr[i] - 40;
 			} else if (BETWEEN(attr[i], 90, 97)) {
-				term.c.attr.fg = attr[i] - 90 + 8;
+				d->fg = attr[i] - 90 + 8;
 			} else if (BETWEEN(attr[i], 100, 107)) {
-				term.c.attr.bg = attr[i] - 100 + 8;
+				d->bg = attr[i] - 100 + 8;
 			} else {
 				fprintf(stderr,
 					"erresc(default): gfx attr %d unknown\n",
 					attr[i]);
 				csidump();
+				ok = 0;
 			}
 			break;
 		}
+		/* sub-parameters of attributes which take none */
+		while (i + 1 < l && sub[i + 1])
+			i++;
 	}
+#undef ATTRSET
+#undef ATTRCLR
+
+	return ok;
+}
+
+void
+tsgrapply(const SGRDelta *d)
+{
+	term.c.attr.mode = (term.c.attr.mode & ~d->clr) | d->set;
+	if (d->fg != COL_KEEP)
+		term.c.attr.fg = (d->fg == COL_DEFAULT) ? defaultfg : d->fg;
+	if (d->bg != COL_KEEP)
+		term.c.attr.bg = (d->bg == COL_DEFAULT) ? defaultbg : d->bg;
 }
 
 void
@@ -1625,6 +3496,9 @@ tsetmode(int priv, int set, const int *args, int narg)
 				}
 				if (set ^ alt) /* set is always 1 or 0 */
 					tswapscreen();
+				if (alt && !set) /* taltfree() counts from now */
+					clock_gettime(CLOCK_MONOTONIC,
+					              &term.alttv);
 				if (*args != 1049)
 					break;
 				/* FALLTHROUGH */
@@ -1634,6 +3508,11 @@ tsetmode(int priv, int set, const int *args, int narg)
 			case 2004: /* 2004: bracketed paste mode */
 				xsetmode(set, MODE_BRCKTPASTE);
 				break;
+			case 2026: /* synchronized update */
+				if (set)
+					clock_gettime(CLOCK_MONOTONIC, &term.synctv);
+				MODBIT(term.mode, set, MODE_SYNC);
+				break;
 			/* Not implemented mouse modes. See comments there. */
 			case 1001: /* mouse highlight mode; can hang the
 				      terminal by design when implemented. */
@@ -1816,7 +3695,7 @@ csihandle(void)
 		break;
 	case 'T': /* SD -- Scroll <n> line down */
 		DEFAULT(csiescseq.arg[0], 1);
-		tscrolldown(term.top, csiescseq.arg[0], 0);
+		tscrolldown(term.top, csiescseq.arg[0]);
 		break;
 	case 'L': /* IL -- Insert <n> blank lines */
 		DEFAULT(csiescseq.arg[0], 1);
@@ -1850,7 +3729,7 @@ csihandle(void)
 		tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
 		break;
 	case 'm': /* SGR -- Terminal attribute (color) */
-		tsetattr(csiescseq.arg, csiescseq.narg);
+		csisgr();
 		break;
 	case 'n': /* DSR – Device Status Report (cursor position) */
 		if (csiescseq.arg[0] == 6) {
@@ -1885,6 +3764,19 @@ csihandle(void)
 			goto unknown;
 		}
 		break;
+	case '$':
+		switch (csiescseq.mode[1]) {
+		case 'p': /* DECRQM -- Request Mode, so apps can detect 2026 */
+			if (!csiescseq.priv || csiescseq.arg[0] != 2026)
+				goto unknown;
+			len = snprintf(buf, sizeof(buf), "\033[?2026;%d$y",
+					IS_SET(MODE_SYNC) ? 1 : 2);
+			ttywrite(buf, len, 0);
+			break;
+		default:
+			goto unknown;
+		}
+		break;
 	}
 }
 
@@ -1912,10 +3804,70 @@ csidump(void)
 	putc('\n', stderr);
 }
 
+/*
+ * The same few SGR sequences make up most of the escapes in colored
+ * output, so their folded attribute changes are kept in a small direct
+ * mapped cache keyed on the raw bytes. sgrstats() reports its hit rate.
+ */
+void
+csisgr(void)
+{
+	SGRDelta d;
+	size_t i, len = csiescseq.len;
+	uint h = 0;
+	int cacheable = len <= SGR_KEY_SIZ;
+
+	if (cacheable) {
+		for (i = 0; i < len; i++)
+			h = h * 31 + (uchar)csiescseq.buf[i];
+		h &= SGR_CACHE_SIZ - 1;
+		if (sgrcache.ent[h].len == len &&
+		    !memcmp(sgrcache.ent[h].key, csiescseq.buf, len)) {
+			sgrcache.hits++;
+			tsgrapply(&sgrcache.ent[h].d);
+			return;
+		}
+	}
+	sgrcache.misses++;
+
+	if (tsgrdelta(&d, csiescseq.arg, csiescseq.sub, csiescseq.narg) &&
+	    cacheable) {
+		memcpy(sgrcache.ent[h].key, csiescseq.buf, len);
+		sgrcache.ent[h].len = len;
+		sgrcache.ent[h].d = d;
+	}
+	tsgrapply(&d);
+}
+
+/*
+ * Prints the hits and misses of the SGR cache to stderr on exit, if
+ * ST_SGRSTATS is set; not through stdio, as sigchld() may call it from
+ * a signal handler.
+ */
+void
+sgrstats(void)
+{
+	char buf[128];
+	ulong n = sgrcache.hits + sgrcache.misses;
+	int len;
+
+	if (!getenv("ST_SGRSTATS"))
+		return;
+	len = snprintf(buf, sizeof(buf), "sgr cache: %lu hits, %lu misses, "
+	               "%lu%% hit rate\n", sgrcache.hits, sgrcache.misses,
+	               n ? sgrcache.hits * 100 / n : 0);
+	xwrite(2, buf, MIN(len, sizeof(buf) - 1));
+}
+
 void
 csireset(void)
 {
-	memset(&csiescseq, 0, sizeof(csiescseq));
+	csiescseq.len = 0;
+	csiescseq.priv = 0;
+	memset(csiescseq.arg, 0, sizeof(csiescseq.arg));
+	memset(csiescseq.sub, 0, sizeof(csiescseq.sub));
+	csiescseq.narg = 0;
+	csiescseq.mode[0] = csiescseq.mode[1] = '\0';
 }
 
 void
@@ -1946,7 +3898,7 @@ osc_color_response(int num, int index, int is_osc4)
 void
 strhandle(void)
 {
-	char *p = NULL, *dec;
+	char *p = NULL;
 	int j, narg, par;
 	const struct { int idx; char *str; } osc_table[] = {
 		{ defaultfg, "foreground" },
@@ -1954,7 +3906,18 @@ strhandle(void)
 		{ defaultcs, "cursor" }
 	};
 
-	term.esc &= ~(ESC_STR_END|ESC_STR);
+	if (strescseq.drop)
+		return;
+	if (strescseq.b64 > 0) {
+		/* OSC 52, the buffer holds the decoded selection */
+		base64end();
+		strescseq.buf[strescseq.len] = '\0';
+		xsetsel(strescseq.buf);
+		xclipcopy();
+		strescseq.buf = NULL;
+		strreset();
+		return;
+	}
 	strparse();
 	par = (narg = strescseq.narg) ? atoi(strescseq.args[0]) : 0;
 
@@ -1975,16 +3938,7 @@ strhandle(void)
 			if (narg > 1)
 				xsettitle(strescseq.args[1]);
 			return;
-		case 52:
-			if (narg > 2 && allowwindowops) {
-				dec = base64dec(strescseq.args[2]);
-				if (dec) {
-					xsetsel(dec);
-					xclipcopy();
-				} else {
-					fprintf(stderr, "erresc: invalid base64\n");
-				}
-			}
+		case 52: /* decoded by strput() if allowwindowops is set */
 			return;
 		case 10:
 		case 11:
@@ -2070,6 +4024,7 @@ externalpipe(const Arg *arg)
 	int to[2];
 	char buf[UTF_SIZ];
 	void (*oldsigpipe)(int);
+	sigset_t set;
 	Glyph *bp, *end;
 	int lastpos, n, newline;
 
@@ -2085,6 +4040,8 @@ externalpipe(const Arg *arg)
 		dup2(to[0], STDIN_FILENO);
 		close(to[0]);
 		close(to[1]);
+		sigemptyset(&set);
+		sigprocmask(SIG_SETMASK, &set, NULL);
 		execvp(((char **)arg->v)[0], (char **)arg->v);
 		fprintf(stderr, "st: execvp %s\n", ((char **)arg->v)[0]);
 		perror("failed");
@@ -2095,7 +4052,8 @@ externalpipe(const Arg *arg)
 	/* ignore sigpipe for now, in case child exists early */
 	oldsigpipe = signal(SIGPIPE, SIG_IGN);
 	newline = 0;
-	for (n = 0; n <= HISTSIZE + 2; n++) {
+	thistwrap(INT_MAX);
+	for (n = 0; n < term.histn + term.row; n++) {
 		bp = TLINE_HIST(n);
 		lastpos = MIN(tlinehistlen(n) + 1, term.col) - 1;
 		if (lastpos < 0)
@@ -2146,6 +4104,57 @@ strdump(void)
 	fprintf(stderr, "ESC\\\n");
 }
 
+/*
+ * Appends to the string sequence. A string which never ends could grow
+ * until st stops responding, so one reaching maxstrlen is dropped: its
+ * buffer is released and the rest of it is ignored up to the terminator.
+ *
+ * The payload of an OSC 52 selection is base64 decoded straight into the
+ * buffer as it arrives, rather than all at once when the string ends.
+ */
+void
+strput(const char *s, size_t len)
+{
+	size_t siz;
+	char *p;
+
+	if (strescseq.drop)
+		return;
+	if (strescseq.len + len >= maxstrlen) {
+		fprintf(stderr, "erresc: %c string longer than %u bytes, dropped\n",
+			strescseq.type, maxstrlen);
+		strreset();
+		strescseq.drop = 1;
+		return;
+	}
+	if (strescseq.len + len >= strescseq.siz) {
+		for (siz = strescseq.siz; siz <= strescseq.len + len; siz *= 2)
+			;
+		strescseq.siz = MIN(siz, maxstrlen);
+		strescseq.buf = xrealloc(strescseq.buf, strescseq.siz);
+	}
+	if (strescseq.b64 > 0) {
+		base64put(s, len);
+		return;
+	}
+	memcpy(&strescseq.buf[strescseq.len], s, len);
+	strescseq.len += len;
+
+	if (strescseq.b64 || strescseq.type != ']')
+		return;
+	/* OSC 52 ; <selection> ; <base64> */
+	if (memcmp(strescseq.buf, "52;", MIN(strescseq.len, 3)) ||
+	    !allowwindowops) {
+		strescseq.b64 = -1;
+	} else if (strescseq.len > 3 &&
+	    (p = memchr(strescseq.buf + 3, ';', strescseq.len - 3))) {
+		strescseq.b64 = 1;
+		siz = strescseq.len - (++p - strescseq.buf);
+		strescseq.len = 0;
+		base64put(p, siz);
+	}
+}
+
 void
 strreset(void)
 {
@@ -2297,7 +4306,6 @@ tstrsequence(uchar c)
 	}
 	strreset();
 	strescseq.type = c;
-	term.esc |= ESC_STR;
 }
 
 void
@@ -2320,18 +4328,8 @@ tcontrolcode(uchar ascii)
 		tnewline(IS_SET(MODE_CRLF));
 		return;
 	case '\a':   /* BEL */
-		if (term.esc & ESC_STR_END) {
-			/* backwards compatibility to xterm */
-			strhandle();
-		} else {
-			xbell();
-		}
+		xbell();
 		break;
-	case '\033': /* ESC */
-		csireset();
-		term.esc &= ~(ESC_CSI|ESC_ALTCHARSET|ESC_TEST);
-		term.esc |= ESC_START;
-		return;
 	case '\016': /* SO (LS1 -- Locking shift 1) */
 	case '\017': /* SI (LS0 -- Locking shift 0) */
 		term.charset = 1 - (ascii - '\016');
@@ -2386,52 +4384,17 @@ tcontrolcode(uchar ascii)
 	case 0x9b:   /* TODO: CSI */
 	case 0x9c:   /* TODO: ST */
 		break;
-	case 0x90:   /* DCS -- Device Control String */
-	case 0x9d:   /* OSC -- Operating System Command */
-	case 0x9e:   /* PM -- Privacy Message */
-	case 0x9f:   /* APC -- Application Program Command */
-		tstrsequence(ascii);
-		return;
 	}
-	/* only CAN, SUB, \a and C1 chars interrupt a sequence */
-	term.esc &= ~(ESC_STR_END|ESC_STR);
 }
 
-/*
- * returns 1 when the sequence is finished and it hasn't to read
- * more characters for this sequence, otherwise 0
- */
-int
+void
 eschandle(uchar ascii)
 {
 	switch (ascii) {
-	case '[':
-		term.esc |= ESC_CSI;
-		return 0;
-	case '#':
-		term.esc |= ESC_TEST;
-		return 0;
-	case '%':
-		term.esc |= ESC_UTF8;
-		return 0;
-	case 'P': /* DCS -- Device Control String */
-	case '_': /* APC -- Application Program Command */
-	case '^': /* PM -- Privacy Message */
-	case ']': /* OSC -- Operating System Command */
-	case 'k': /* old title set compatibility */
-		tstrsequence(ascii);
-		return 0;
 	case 'n': /* LS2 -- Locking shift 2 */
 	case 'o': /* LS3 -- Locking shift 3 */
 		term.charset = 2 + (ascii - 'n');
 		break;
-	case '(': /* GZD4 -- set primary charset G0 */
-	case ')': /* G1D4 -- set secondary charset G1 */
-	case '*': /* G2D4 -- set tertiary charset G2 */
-	case '+': /* G3D4 -- set quaternary charset G3 */
-		term.icharset = ascii - '(';
-		term.esc |= ESC_ALTCHARSET;
-		return 0;
 	case 'D': /* IND -- Linefeed */
 		if (term.c.y == term.bot) {
 			tscrollup(term.top, 1, 1);
@@ -2447,7 +4410,7 @@ eschandle(uchar ascii)
 		break;
 	case 'M': /* RI -- Reverse index */
 		if (term.c.y == term.top) {
-			tscrolldown(term.top, 1, 1);
+			tscrolldown(term.top, 1);
 		} else {
 			tmoveto(term.c.x, term.c.y-1);
 		}
@@ -2472,121 +4435,108 @@ eschandle(uchar ascii)
 	case '8': /* DECRC -- Restore Cursor */
 		tcursor(CURSOR_LOAD);
 		break;
-	case '\\': /* ST -- String Terminator */
-		if (term.esc & ESC_STR_END)
-			strhandle();
-		break;
 	default:
 		fprintf(stderr, "erresc: unknown sequence ESC 0x%02X '%c'\n",
 			(uchar) ascii, isprint(ascii)? ascii:'.');
 		break;
 	}
-	return 1;
+}
+
+int
+runeclass(Rune u)
+{
+	if (u < 0x80)
+		return asciiclass[u];
+	if (u >= 0xA0)
+		return CLS_PRINT;
+	return (u == 0x90 || u >= 0x9d) ? CLS_C1STR : CLS_C1;
+}
+
+void
+escaction(int act, Rune u, const char *c, int len)
+{
+	switch (act) {
+	case ACT_EXEC:
+		tcontrolcode(u);
+		break;
+	case ACT_ESC:
+		eschandle(u);
+		break;
+	case ACT_ESCSTART:
+		csireset();
+		break;
+	case ACT_CSIPUT:
+	case ACT_CSIEND:
+		csiescseq.buf[csiescseq.len++] = u;
+		csiparse(u);
+		if (act == ACT_CSIPUT
+				&& csiescseq.len < sizeof(csiescseq.buf)-1)
+			break;
+		term.esc = ESC_GROUND;
+		csihandle();
+		break;
+	case ACT_STRSTART:
+		tstrsequence(u);
+		break;
+	case ACT_STRPUT:
+		strput(c, len);
+		break;
+	case ACT_STREND:
+		strhandle();
+		break;
+	case ACT_CSSEL:
+		term.icharset = u - '(';
+		break;
+	case ACT_CS:
+		tdeftran(u);
+		break;
+	case ACT_TEST:
+		tdectest(u);
+		break;
+	case ACT_UTF8:
+		tdefutf8(u);
+		break;
+	}
 }
 
 void
 tputc(Rune u)
 {
 	char c[UTF_SIZ];
-	int control;
-	int width, len;
+	int control, act, cls;
+	int width = 1, len;
 	Glyph *gp;
 
 	control = ISCONTROL(u);
 	if (u < 127 || !IS_SET(MODE_UTF8)) {
 		c[0] = u;
-		width = len = 1;
+		len = 1;
 	} else {
 		len = utf8encode(u, c);
-		if (!control && (width = wcwidth(u)) == -1)
-			width = 1;
+		if (!control)
+			width = runewidth(u);
 	}
 
 	if (IS_SET(MODE_PRINT))
 		tprinter(c, len);
 
 	/*
-	 * STR sequence must be checked before anything else
-	 * because it uses all following characters until it
-	 * receives a ESC, a SUB, a ST or any other C1 control
-	 * character.
-	 */
-	if (term.esc & ESC_STR) {
-		if (u == '\a' || u == 030 || u == 032 || u == 033 ||
-		   ISCONTROLC1(u)) {
-			term.esc &= ~(ESC_START|ESC_STR);
-			term.esc |= ESC_STR_END;
-			goto check_control_code;
-		}
-
-		if (strescseq.len+len >= strescseq.siz) {
-			/*
-			 * Here is a bug in terminals. If the user never sends
-			 * some code to stop the str or esc command, then st
-			 * will stop responding. But this is better than
-			 * silently failing with unknown characters. At least
-			 * then users will report back.
-			 *
-			 * In the case users ever get fixed, here is the code:
-			 */
-			/*
-			 * term.esc = 0;
-			 * strhandle();
-			 */
-			if (strescseq.siz > (SIZE_MAX - UTF_SIZ) / 2)
-				return;
-			strescseq.siz *= 2;
-			strescseq.buf = xrealloc(strescseq.buf, strescseq.siz);
-		}
-
-		memmove(&strescseq.buf[strescseq.len], c, len);
-		strescseq.len += len;
-		return;
-	}
-
-check_control_code:
-	/*
-	 * Actions of control codes must be performed as soon they arrive
-	 * because they can be embedded inside a control sequence, and
-	 * they must not cause conflicts with sequences.
+	 * The state is switched before acting, because some actions
+	 * (REP, replies echoed back) feed more runes through here.
 	 */
-	if (control) {
-		tcontrolcode(u);
+	cls = runeclass(u);
+	act = esctrans[term.esc][cls].act;
+	term.esc = esctrans[term.esc][cls].next;
+	if (act != ACT_PRINT) {
+		escaction(act, u, c, len);
 		/*
 		 * control codes are not shown ever
 		 */
-		if (!term.esc)
+		if (control && term.esc == ESC_GROUND)
 			term.lastc = 0;
 		return;
-	} else if (term.esc & ESC_START) {
-		if (term.esc & ESC_CSI) {
-			csiescseq.buf[csiescseq.len++] = u;
-			if (BETWEEN(u, 0x40, 0x7E)
-					|| csiescseq.len >= \
-					sizeof(csiescseq.buf)-1) {
-				term.esc = 0;
-				csiparse();
-				csihandle();
-			}
-			return;
-		} else if (term.esc & ESC_UTF8) {
-			tdefutf8(u);
-		} else if (term.esc & ESC_ALTCHARSET) {
-			tdeftran(u);
-		} else if (term.esc & ESC_TEST) {
-			tdectest(u);
-		} else {
-			if (!eschandle(u))
-				return;
-			/* sequence already finished */
-		}
-		term.esc = 0;
-		/*
-		 * All characters which form part of a sequence are not
-		 * printed
-		 */
-		return;
 	}
+
 	if (selected(term.c.x, term.c.y))
 		selclear();
 
@@ -2626,14 +4576,306 @@ check_control_code:
 	}
 }
 
+/*
+ * returns the length of the run of printable ASCII (0x20 - 0x7E) at the
+ * start of s
+ */
+int
+tscanascii(const char *s, int n)
+{
+	int i = 0;
+#if defined(__SSE2__)
+	__m128i v;
+
+	/*
+	 * adding 0x60 maps 0x20 - 0x7E onto -128 - -34 as signed bytes and
+	 * everything else above that, so a single signed compare does it
+	 */
+	for (; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		v = _mm_add_epi8(v, _mm_set1_epi8(0x60));
+		if (_mm_movemask_epi8(_mm_cmplt_epi8(v, _mm_set1_epi8(-33))) != 0xFFFF)
+			break;
+	}
+#endif
+	while (i < n && BETWEEN((uchar)s[i], 0x20, 0x7E))
+		i++;
+
+	return i;
+}
+
+/*
+ * returns the length of the run of printable ASCII, CR and LF at the start
+ * of s and stores the number of LFs in it in nl
+ */
+int
+tscanlines(const char *s, int n, int *nl)
+{
+	int i = 0;
+
+	*nl = 0;
+	while (i < n) {
+		i += tscanascii(s + i, n - i);
+		if (i < n && s[i] == '\n')
+			(*nl)++;
+		else if (i == n || s[i] != '\r')
+			break;
+		i++;
+	}
+
+	return i;
+}
+
+/*
+ * returns the length of the run of ASCII at the start of s which a string
+ * sequence takes as is, that is up to a BEL, CAN, SUB or ESC terminator
+ * or a byte which needs decoding
+ */
+int
+tscanstr(const char *s, int n)
+{
+	int i = 0;
+	uchar c;
+#if defined(__SSE2__)
+	__m128i v, t;
+
+	for (; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		t = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\a')),
+			             _mm_cmpeq_epi8(v, _mm_set1_epi8('\033'))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\030')),
+			             _mm_cmpeq_epi8(v, _mm_set1_epi8('\032'))));
+		if (_mm_movemask_epi8(_mm_or_si128(v, t)))
+			break;
+	}
+#endif
+	for (; i < n; i++) {
+		c = s[i];
+		if (c >= 0x80 || c == '\a' || c == '\033' || c == '\030' ||
+		    c == '\032')
+			break;
+	}
+
+	return i;
+}
+
+/*
+ * tputc() for a run of printable ASCII written outside of any sequence,
+ * in insert-less mode and with a non graphic charset. Every row touched
+ * is filled in one pass and wrapping is only dealt with at row ends.
+ */
+void
+tputascii(const char *s, int n)
+{
+	int i, len, x, y;
+	Glyph *gp;
+
+	while (n > 0) {
+		if (sel.ob.x != -1 && selected(term.c.x, term.c.y))
+			selclear();
+
+		if (term.c.state & CURSOR_WRAPNEXT) {
+			if (IS_SET(MODE_WRAP)) {
+				term.line[term.c.y][term.c.x].mode |= ATTR_WRAP;
+				tnewline(1);
+			} else if (term.c.x == term.col - 1) {
+				/* every char lands on the last column */
+				s += n - 1;
+				n = 1;
+			}
+		}
+
+		x = term.c.x;
+		y = term.c.y;
+		len = MIN(n, term.col - x);
+		if (sel.ob.x != -1) {
+			for (i = 1; i < len; i++) {
+				if (selected(x + i, y)) {
+					selclear();
+					break;
+				}
+			}
+		}
+
+		for (i = 0, gp = &term.line[y][x]; i < len; i++, gp++) {
+			/* same wide char cleanup as tsetchar() */
+			if (gp->mode & ATTR_WIDE) {
+				if (x + i + 1 < term.col) {
+					gp[1].u = ' ';
+					gp[1].mode &= ~ATTR_WDUMMY;
+				}
+			} else if ((gp->mode & ATTR_WDUMMY) && x + i > 0) {
+				gp[-1].u = ' ';
+				gp[-1].mode &= ~ATTR_WIDE;
+			}
+			*gp = term.c.attr;
+			gp->u = (uchar)s[i];
+		}
+		term.dirty[y] = 1;
+		term.lastc = (uchar)s[len - 1];
+
+		if (x + len < term.col) {
+			tmoveto(x + len, y);
+		} else {
+			term.c.x = term.col - 1;
+			term.c.state |= CURSOR_WRAPNEXT;
+		}
+		s += len;
+		n -= len;
+	}
+}
+
+/*
+ * scrolls the main screen by a row for tputlines() and returns the new last
+ * row, blank, or NULL if it is not to be written; the row scrolled off is
+ * not packed either unless keep is set
+ */
+Line
+tlinesnext(int write, int keep)
+{
+	Line line;
+
+	line = tringnext();
+	thistpack(keep);
+	if (!write)
+		return NULL;
+	tblankline(line, term.col);
+
+	return line;
+}
+
+/*
+ * tputascii() and tnewline() for a run of printable ASCII, CR and LF with
+ * the cursor on the last row of the main screen and all of it as scroll
+ * region, the conditions tputascii() needs holding as well. Such a run is
+ * mostly lines which scroll off at once: each line feed just moves the
+ * origin of the ring, the screen is marked dirty once at the end, and a
+ * first pass counts the rows, so that those the ring would lose again
+ * before the end are neither written nor packed.
+ */
+void
+tputlines(const char *s, int n)
+{
+	int i, j, k, m, end, x, wrapnext, pass, rows, skip = 0;
+	Glyph *gp, *line = NULL;
+
+	if (sel.ob.x != -1)
+		selclear();
+
+	for (pass = 0; pass < 2; pass++) {
+		x = term.c.x;
+		wrapnext = term.c.state & CURSOR_WRAPNEXT;
+		rows = 0;
+		if (pass)
+			line = (skip <= 0) ? term.line[term.row - 1] : NULL;
+
+		for (i = 0; i < n; i++) {
+			if (s[i] == '\r' || s[i] == '\n') {
+				if (s[i] == '\n') {
+					rows++;
+					if (pass)
+						line = tlinesnext(rows >= skip,
+						                  rows - term.row >= skip);
+				}
+				if (s[i] == '\r' || IS_SET(MODE_CRLF))
+					x = 0;
+				wrapnext = 0;
+				continue;
+			}
+			end = i + tscanascii(s + i, n - i);
+			for (j = i; j < end; j += k) {
+				if (wrapnext) {
+					if (IS_SET(MODE_WRAP)) {
+						if (line)
+							line[x].mode |= ATTR_WRAP;
+						rows++;
+						if (pass)
+							line = tlinesnext(rows >= skip,
+							                  rows - term.row >= skip);
+						x = 0;
+					} else if (x == term.col - 1) {
+						/* every char lands on the last column */
+						j = end - 1;
+					}
+				}
+				k = MIN(end - j, term.col - x);
+				for (m = 0, gp = line + x; line && m < k; m++, gp++) {
+					/* same wide char cleanup as tsetchar() */
+					if (gp->mode & ATTR_WIDE) {
+						if (x + m + 1 < term.col) {
+							gp[1].u = ' ';
+							gp[1].mode &= ~ATTR_WDUMMY;
+						}
+					} else if ((gp->mode & ATTR_WDUMMY) && x + m > 0) {
+						gp[-1].u = ' ';
+						gp[-1].mode &= ~ATTR_WIDE;
+					}
+					*gp = term.c.attr;
+					gp->u = (uchar)s[j + m];
+				}
+				if (x + k < term.col) {
+					x += k;
+					wrapnext = 0;
+				} else {
+					x = term.col - 1;
+					wrapnext = 1;
+				}
+			}
+			i = end - 1;
+		}
+		/* the ring keeps no more than the last histsize rows */
+		skip = rows - (int)histsize - term.row + 1;
+	}
+
+	term.c.x = x;
+	if (wrapnext)
+		term.c.state |= CURSOR_WRAPNEXT;
+	else
+		term.c.state &= ~CURSOR_WRAPNEXT;
+	term.lastc = BETWEEN((uchar)s[n - 1], 0x20, 0x7E) ? (uchar)s[n - 1] : 0;
+	tfulldirt();
+}
+
 int
 twrite(const char *buf, int buflen, int show_ctrl)
 {
-	int charsize;
+	int charsize, nl, plain = 0;
 	Rune u;
 	int n;
 
 	for (n = 0; n < buflen; n += charsize) {
+		/*
+		 * Lines which will scroll off anyway are not worth the trip
+		 * through tputc(). Floods are looked for at line starts only
+		 * and plain marks the end of the last run looked at, so a run
+		 * is never scanned twice.
+		 */
+		if (n >= plain && (n == 0 || buf[n - 1] == '\n') &&
+		    term.esc == ESC_GROUND &&
+		    !IS_SET(MODE_INSERT|MODE_PRINT) &&
+		    term.trantbl[term.charset] != CS_GRAPHIC0 &&
+		    term.top == 0 && term.bot == term.row - 1 &&
+		    term.c.y == term.bot && term.scr == 0 &&
+		    !IS_SET(MODE_ALTSCREEN)) {
+			charsize = tscanlines(buf + n, buflen - n, &nl);
+			plain = n + charsize;
+			if (nl >= term.row) {
+				tputlines(buf + n, charsize);
+				continue;
+			}
+		}
+		if (term.esc == ESC_GROUND && !IS_SET(MODE_INSERT|MODE_PRINT) &&
+		    term.trantbl[term.charset] != CS_GRAPHIC0 &&
+		    (charsize = tscanascii(buf + n, buflen - n)) > 0) {
+			tputascii(buf + n, charsize);
+			continue;
+		}
+		if (term.esc == ESC_STR && !show_ctrl && !IS_SET(MODE_PRINT) &&
+		    (charsize = tscanstr(buf + n, buflen - n)) > 0) {
+			strput(buf + n, charsize);
+			continue;
+		}
 		if (IS_SET(MODE_UTF8)) {
 			/* process a complete utf8 char */
 			charsize = utf8decode(buf + n, &u, buflen - n);
@@ -2661,10 +4903,12 @@ twrite(const char *buf, int buflen, int show_ctrl)
 void
 tresize(int col, int row)
 {
-	int i, j;
-	int tmp;
-	int minrow, mincol;
+	int i;
+	int tmp, ocol = term.col, ox = term.c.x;
+	int minrow, mincol, slide, hist;
 	int *bp;
+	Line *ring, *scr, **alt;
+	uchar **packed;
 	TCursor c;
 
 	tmp = col;
@@ -2685,45 +4929,88 @@ tresize(int col, int row)
 	 * tscrollup would work here, but we can optimize to
 	 * memmove because we're freeing the earlier lines
 	 */
+	if (IS_SET(MODE_ALTSCREEN)) {
+		scr = term.alt;
+		alt = &term.line;
+	} else {
+		scr = term.line;
+		alt = &term.alt;
+	}
 	for (i = 0; i <= term.c.y - row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
+		linefree(scr[i]);
+		if (*alt)
+			linefree((*alt)[i]);
 	}
+	slide = i;
 	/* ensure that both src and dst are not NULL */
-	if (i > 0) {
-		memmove(term.line, term.line + i, row * sizeof(Line));
-		memmove(term.alt, term.alt + i, row * sizeof(Line));
-	}
+	if (i > 0 && *alt)
+		memmove(*alt, *alt + i, row * sizeof(Line));
 	for (i += row; i < term.row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
+		linefree(scr[i]);
+		if (*alt)
+			linefree((*alt)[i]);
 	}
 
-	/* resize to new height */
-	term.line = xrealloc(term.line, row * sizeof(Line));
-	term.alt  = xrealloc(term.alt,  row * sizeof(Line));
+	/*
+	 * resize to new height, the ring keeps the history as it is; there
+	 * is always a row for it, thistpush() takes one even if histsize is 0.
+	 * A change of width alone leaves the ring as it is.
+	 */
+	if (row != term.row) {
+		hist = term.ring ? term.nring - term.row : 1;
+		ring = xmalloc(2 * (hist + row) * sizeof(Line));
+		packed = xmalloc((hist + row) * sizeof(*packed));
+		memset(ring, 0, 2 * (hist + row) * sizeof(Line));
+		memset(packed, 0, (hist + row) * sizeof(*packed));
+		for (i = 0; term.hist && i < hist; i++)
+			packed[i] = term.hist[(term.org + i) % term.nring];
+		for (i = 0; i < minrow; i++)
+			ring[hist + i] = scr[slide + i];
+		free(term.ring);
+		free(term.hist);
+		term.ring = ring;
+		term.hist = packed;
+		term.nring = hist + row;
+		term.org = 0;
+	}
+	if (*alt)
+		*alt = xrealloc(*alt, row * sizeof(Line));
 	term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
 	term.tabs = xrealloc(term.tabs, col * sizeof(*term.tabs));
 
-	for (i = 0; i < HISTSIZE; i++) {
-		term.hist[i] = xrealloc(term.hist[i], col * sizeof(Glyph));
-		for (j = mincol; j < col; j++) {
-			term.hist[i][j] = term.c.attr;
-			term.hist[i][j].u = ' ';
-		}
+	/* history rows are unpacked again, as wide as the others */
+	for (i = row; i < term.row; i++)
+		linefree(term.hline[i]);
+	term.hline = xrealloc(term.hline, row * sizeof(Line));
+	term.htag = xrealloc(term.htag, row * sizeof(*term.htag));
+	for (i = 0; i < row; i++) {
+		if (i >= term.row)
+			term.hline[i] = NULL;
+		else if (term.hline[i])
+			term.hline[i] = linerealloc(term.hline[i], col);
+		term.htag[i] = ~0UL;
 	}
+	linefree(term.spare);
+	term.spare = NULL;
 
 	/* resize each row to new width, zero-pad if needed */
+	scr = term.ring + term.org + term.nring - row;
 	for (i = 0; i < minrow; i++) {
-		term.line[i] = xrealloc(term.line[i], col * sizeof(Glyph));
-		term.alt[i]  = xrealloc(term.alt[i],  col * sizeof(Glyph));
+		scr[i] = linerealloc(scr[i], col);
+		if (*alt)
+			(*alt)[i] = linerealloc((*alt)[i], col);
 	}
 
 	/* allocate any new rows */
 	for (/* i = minrow */; i < row; i++) {
-		term.line[i] = xmalloc(col * sizeof(Glyph));
-		term.alt[i] = xmalloc(col * sizeof(Glyph));
+		scr[i] = linealloc(col);
+		if (*alt)
+			(*alt)[i] = linealloc(col);
 	}
+	if (IS_SET(MODE_ALTSCREEN))
+		term.alt = scr;
+	else
+		term.line = scr;
 	if (col > term.maxcol) {
 		bp = term.tabs + term.maxcol;
 
@@ -2737,6 +5024,7 @@ tresize(int col, int row)
 	term.col = tmp;
 	term.maxcol = col;
 	term.row = row;
+	tringsync(0, row - 1);
 	/* reset scrolling region */
 	tsetscroll(0, row-1);
 	/* make use of the LIMIT in tmoveto */
@@ -2750,10 +5038,18 @@ tresize(int col, int row)
 		if (0 < col && minrow < row) {
 			tclearregion(0, minrow, col - 1, row - 1);
 		}
+		if (!term.alt)
+			break;
 		tswapscreen();
 		tcursor(CURSOR_LOAD);
 	}
 	term.c = c;
+
+	if (ocol && term.col != ocol) {
+		if (!IS_SET(MODE_ALTSCREEN))
+			term.c.x = ox;
+		treflow(ocol);
+	}
 }
 
 void
@@ -2763,23 +5059,23 @@ resettitle(void)
 }
 
 void
-drawregion(int x1, int y1, int x2, int y2)
+snapline(Line dst, const Line src, int y)
 {
-	int y;
-
-	for (y = y1; y < y2; y++) {
-		if (!term.dirty[y])
-			continue;
+	int x;
 
-		term.dirty[y] = 0;
-		xdrawline(TLINE(y), x1, y, x2);
+	memcpy(dst, src, term.col * sizeof(Glyph));
+	for (x = 0; x < term.col; x++) {
+		if (!(dst[x].mode & ATTR_WDUMMY) && selected(x, y))
+			dst[x].mode |= ATTR_SELECTED;
 	}
 }
 
 void
 draw(void)
 {
-	int cx = term.c.x, ocx = term.ocx, ocy = term.ocy;
+	int cx = term.c.x, cy = term.c.y, ocx = term.ocx, ocy = term.ocy;
+	int ox, oy, y, row, col, cursor;
+	Glyph g, og;
 
 	if (!xstartdraw())
 		return;
@@ -2789,22 +5085,57 @@ draw(void)
 	LIMIT(term.ocy, 0, term.row-1);
 	if (term.line[term.ocy][term.ocx].mode & ATTR_WDUMMY)
 		term.ocx--;
-	if (term.line[term.c.y][cx].mode & ATTR_WDUMMY)
+	if (term.line[cy][cx].mode & ATTR_WDUMMY)
 		cx--;
 
-	drawregion(0, 0, term.col, term.row);
-	if (term.scr == 0)
-		xdrawcursor(cx, term.c.y, term.line[term.c.y][cx],
-				term.ocx, term.ocy, term.line[term.ocy][term.ocx],
-				term.line[term.ocy], term.col);
-	/* xdrawcursor(cx, term.c.y, term.line[term.c.y][cx], */
-	/* 		term.ocx, term.ocy, term.line[term.ocy][term.ocx], */
-	/* 		term.line[term.ocy], term.col); */
+	if (snap.row != term.row || snap.col != term.col) {
+		for (y = 0; y < snap.row; y++)
+			free(snap.line[y]);
+		snap.line = xrealloc(snap.line, term.row * sizeof(Line));
+		snap.dirty = xrealloc(snap.dirty, term.row * sizeof(int));
+		for (y = 0; y < term.row; y++)
+			snap.line[y] = xmalloc(term.col * sizeof(Glyph));
+		snap.cline = xrealloc(snap.cline, term.col * sizeof(Glyph));
+		snap.row = term.row;
+		snap.col = term.col;
+	}
+
+	/*
+	 * Copy what has to be drawn while the caller holds termlock, and
+	 * render the copy without it, so a slow frame does not keep the
+	 * tty thread from reading.
+	 */
+	for (y = 0; y < term.row; y++) {
+		if ((snap.dirty[y] = term.dirty[y])) {
+			term.dirty[y] = 0;
+			snapline(snap.line[y], TLINE(y), y);
+		}
+	}
+	if ((cursor = term.scr == 0)) {
+		snapline(snap.cline, term.line[term.ocy], term.ocy);
+		og = snap.cline[term.ocx];
+		g = term.line[cy][cx];
+		if (selected(cx, cy))
+			g.mode |= ATTR_SELECTED;
+	}
+	ox = term.ocx;
+	oy = term.ocy;
+	row = term.row;
+	col = term.col;
 	term.ocx = cx;
-	term.ocy = term.c.y;
+	term.ocy = cy;
+
+	tunlock();
+	for (y = 0; y < row; y++) {
+		if (snap.dirty[y])
+			xdrawline(snap.line[y], 0, y, col);
+	}
+	if (cursor)
+		xdrawcursor(cx, cy, g, ox, oy, og, snap.cline, col);
 	xfinishdraw();
-	if (ocx != term.ocx || ocy != term.ocy)
-		xximspot(term.ocx, term.ocy);
+	if (ocx != cx || ocy != cy)
+		xximspot(cx, cy);
+	tlock();
 }
 
 void
@@ -36,6 +36,7 @@ enum glyph_attribute {
 	ATTR_WDUMMY     = 1 << 10,
 	ATTR_BOXDRAW    = 1 << 11,
 	ATTR_LIGA       = 1 << 12,
+	ATTR_SELECTED   = 1 << 13, /* only set in the rows handed to x.c */
 	ATTR_BOLD_FAINT = ATTR_BOLD | ATTR_FAINT,
 };
 
@@ -82,6 +83,7 @@ typedef union {
 
 void die(const char *, ...);
 void redraw(void);
+void sigchld(int);
 void tfulldirt(void);
 void draw(void);
 
@@ -95,13 +97,22 @@ void sendbreak(const Arg *);
 void toggleprinter(const Arg *);
 
 int tattrset(int);
+void tlock(void);
 void tnew(int, int);
 void tresize(int, int);
+int tinsync(uint);
+int taltfree(uint);
 void tsetdirtattr(int);
+void tunlock(void);
 void ttyhangup(void);
 int ttynew(const char *, char *, const char *, char **);
+void ttypaste(const char *, size_t, int, int);
+void ttypastecancel(void);
+size_t ttypasteroom(void);
 size_t ttyread(void);
+void ttyreap(void);
 void ttyresize(int, int);
+int ttythread(void);
 void ttywrite(const char *, size_t, int);
 
 void resettitle(void);
@@ -137,6 +148,10 @@ extern int allowaltscreen;
 extern int allowwindowops;
 extern char *termname;
 extern unsigned int tabspaces;
+extern unsigned int maxstrlen;
+extern unsigned int histsize;
+extern unsigned int histmem;
+extern unsigned int parsebudget;
 extern unsigned int defaultfg;
 extern unsigned int defaultbg;
 extern float alpha;
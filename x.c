@@ -3,11 +3,17 @@
 #include <math.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <signal.h>
 #include <sys/select.h>
 #include <time.h>
 #include <unistd.h>
 #include <libgen.h>
+#if defined(__linux)
+ #include <sys/epoll.h>
+ #include <sys/signalfd.h>
+ #include <sys/timerfd.h>
+#endif
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <X11/cursorfont.h>
@@ -70,6 +76,7 @@ static void clipcopy(const Arg *);
 static void clippaste(const Arg *);
 static void numlock(const Arg *);
 static void selpaste(const Arg *);
+static void pastecancel(const Arg *);
 static void changealpha(const Arg *);
 static void zoom(const Arg *);
 static void zoomabs(const Arg *);
@@ -101,6 +108,9 @@ typedef struct {
 	int cw; /* char width  */
 	int mode; /* window state/mode flags */
 	int cursor; /* cursor style */
+	int pw, ph; /* window size to apply at the next frame, 0 if none */
+	int ttystale; /* the tty was not told the size yet */
+	struct timespec ttytold; /* when the tty was last told it */
 } TermWindow;
 
 typedef struct {
@@ -124,15 +134,45 @@ typedef struct {
 	int depth; /* bit depth */
 	int l, t; /* left and top offset */
 	int gm; /* geometry mask */
+	char *title; /* shown again after the progress of a paste */
 } XWindow;
 
 typedef struct {
-	Atom xtarget;
+	Atom xtarget, incratom;
 	char *primary, *clipboard;
 	struct timespec tclick1;
 	struct timespec tclick2;
+	struct {
+		Atom property; /* holds the data, None if no paste runs */
+		ulong ofs;     /* read so far, in 32-bit units */
+		ulong done;    /* bytes pasted */
+		ulong left;    /* bytes still in the property */
+		int incr;      /* the data comes in INCR chunks */
+		int ready;     /* the property holds data to paste */
+		int shown;     /* the title shows the progress */
+		struct timespec tshow;
+	} paste;
 } XSelection;
 
+/* what woke run() up */
+enum loop_event {
+	EV_X     = 1 << 0,
+	EV_TTY   = 1 << 1,
+	EV_CHLD  = 1 << 2,
+	EV_TIMER = 1 << 3,
+};
+
+typedef struct {
+	int fd[4];   /* watched fds */
+	int ev[4];   /* loop_event of each */
+	int n;
+#if defined(__linux)
+	int epfd;
+	int timerfd; /* armed to the deadline of run() */
+	int armed;
+#endif
+} Loop;
+
 /* Font structure */
 #define Font Font_
 typedef struct {
@@ -170,6 +210,7 @@ static int xicdestroy(XIC, XPointer, XPointer);
 static void xinit(int, int);
 static void cresize(int, int);
 static void xresize(int, int);
+static double xttyresize(void);
 static void xhints(void);
 static int xloadcolor(int, const char *, Color *);
 static int xloadfont(Font *, FcPattern *);
@@ -179,6 +220,10 @@ static void xloadfonts(const char *, double);
 static void xunloadfont(Font *);
 static void xunloadfonts(void);
 static void xsetenv(void);
+static void xsetwmname(char *);
+static void loopinit(int);
+static void loopwatch(int, int);
+static int loopwait(double);
 static void xseturgency(int);
 static int evcol(XEvent *);
 static int evrow(XEvent *);
@@ -198,6 +243,8 @@ static void bpress(XEvent *);
 static void bmotion(XEvent *);
 static void propnotify(XEvent *);
 static void selnotify(XEvent *);
+static void pastefill(void);
+static void pasteend(void);
 static void selclear_(XEvent *);
 static void selrequest(XEvent *);
 static void setsel(char *, Time);
@@ -239,7 +286,13 @@ static void (*handler[LASTEvent])(XEvent *) = {
 static DC dc;
 static XWindow xw;
 static XSelection xsel;
+static Loop loop;
 static TermWindow win;
+/*
+ * Held from xstartdraw() to xfinishdraw(), so the tty thread cannot
+ * change colors or modes halfway through a frame.
+ */
+static pthread_mutex_t drawlock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Font Ring Cache */
 enum {
@@ -268,6 +321,7 @@ static char *opt_class = NULL;
 static char **opt_cmd  = NULL;
 static char *opt_embed = NULL;
 static char *opt_font  = NULL;
+static char *opt_hist  = NULL;
 static char *opt_io    = NULL;
 static char *opt_line  = NULL;
 static char *opt_name  = NULL;
@@ -298,6 +352,10 @@ clippaste(const Arg *dummy)
 {
 	Atom clipboard;
 
+	/* the owner would overwrite the property of the running paste */
+	if (xsel.paste.property != None)
+		return;
+
 	clipboard = XInternAtom(xw.dpy, "CLIPBOARD", 0);
 	XConvertSelection(xw.dpy, clipboard, xsel.xtarget, clipboard,
 			xw.win, CurrentTime);
@@ -306,10 +364,21 @@ clippaste(const Arg *dummy)
 void
 selpaste(const Arg *dummy)
 {
+	if (xsel.paste.property != None)
+		return;
+
 	XConvertSelection(xw.dpy, XA_PRIMARY, xsel.xtarget, XA_PRIMARY,
 			xw.win, CurrentTime);
 }
 
+void
+pastecancel(const Arg *dummy)
+{
+	ttypastecancel();
+	if (xsel.paste.property != None)
+		pasteend();
+}
+
 void
 numlock(const Arg *dummy)
 {
@@ -557,44 +626,52 @@ propnotify(XEvent *e)
 void
 selnotify(XEvent *e)
 {
-	ulong nitems, ofs, rem;
-	int format;
-	uchar *data, *last, *repl;
-	Atom type, incratom, property = None;
-
-	incratom = XInternAtom(xw.dpy, "INCR", 0);
+	if (e->type == SelectionNotify) {
+		if (e->xselection.property == None)
+			return;
+		xsel.paste.property = e->xselection.property;
+		xsel.paste.ofs = xsel.paste.done = xsel.paste.left = 0;
+		xsel.paste.incr = 0;
+		xsel.paste.ready = 1;
+		clock_gettime(CLOCK_MONOTONIC, &xsel.paste.tshow);
+	} else if (e->type == PropertyNotify) {
+		if (!xsel.paste.incr || e->xproperty.atom != xsel.paste.property)
+			return;
+		/* the selection owner sent the next chunk */
+		xsel.paste.ready = 1;
+	}
 
-	ofs = 0;
-	if (e->type == SelectionNotify)
-		property = e->xselection.property;
-	else if (e->type == PropertyNotify)
-		property = e->xproperty.atom;
+	pastefill();
+}
 
-	if (property == None)
-		return;
+/*
+ * Move as much of the selection from its property to the paste queue as
+ * the queue takes; the rest stays with the X server, and in the
+ * selection owner for INCR transfers, until the tty took what was
+ * queued before.
+ */
+void
+pastefill(void)
+{
+	ulong nitems, rem, len, n;
+	int format, last;
+	uchar *data;
+	Atom type;
+	struct timespec now;
+	char title[64];
 
-	do {
-		if (XGetWindowProperty(xw.dpy, xw.win, property, ofs,
-					BUFSIZ/4, False, AnyPropertyType,
-					&type, &format, &nitems, &rem,
-					&data)) {
+	while (xsel.paste.ready && (len = ttypasteroom() / 4) > 0) {
+		if (XGetWindowProperty(xw.dpy, xw.win, xsel.paste.property,
+					xsel.paste.ofs, len, False,
+					AnyPropertyType, &type, &format,
+					&nitems, &rem, &data)) {
 			fprintf(stderr, "Clipboard allocation failed\n");
+			pastecancel(NULL);
 			return;
 		}
 
-		if (e->type == PropertyNotify && nitems == 0 && rem == 0) {
-			/*
-			 * If there is some PropertyNotify with no data, then
-			 * this is the signal of the selection owner that all
-			 * data has been transferred. We won't need to receive
-			 * PropertyNotify events anymore.
-			 */
-			MODBIT(xw.attrs.event_mask, 0, PropertyChangeMask);
-			XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask,
-					&xw.attrs);
-		}
-
-		if (type == incratom) {
+		if (type == xsel.incratom) {
+			XFree(data);
 			/*
 			 * Activate the PropertyNotify events so we receive
 			 * when the selection owner does send us the next
@@ -607,38 +684,81 @@ selnotify(XEvent *e)
 			/*
 			 * Deleting the property is the transfer start signal.
 			 */
-			XDeleteProperty(xw.dpy, xw.win, (int)property);
-			continue;
+			XDeleteProperty(xw.dpy, xw.win, xsel.paste.property);
+			xsel.paste.incr = 1;
+			xsel.paste.ready = 0;
+			break;
 		}
 
-		/*
-		 * As seen in getsel:
-		 * Line endings are inconsistent in the terminal and GUI world
-		 * copy and pasting. When receiving some selection data,
-		 * replace all '\n' with '\r'.
-		 * FIXME: Fix the computer world.
-		 */
-		repl = data;
-		last = data + nitems * format / 8;
-		while ((repl = memchr(repl, '\n', last - repl))) {
-			*repl++ = '\r';
+		n = nitems * format / 8;
+		if (xsel.paste.incr && xsel.paste.ofs == 0 && n == 0) {
+			/*
+			 * A chunk with no data is the signal of the selection
+			 * owner that all data has been transferred.
+			 */
+			XFree(data);
+			ttypaste(NULL, 0, IS_SET(MODE_BRCKTPASTE), 1);
+			pasteend();
+			break;
 		}
 
-		if (IS_SET(MODE_BRCKTPASTE) && ofs == 0)
-			ttywrite("\033[200~", 6, 0);
-		ttywrite((char *)data, nitems * format / 8, 1);
-		if (IS_SET(MODE_BRCKTPASTE) && rem == 0)
-			ttywrite("\033[201~", 6, 0);
+		last = !xsel.paste.incr && rem == 0;
+		ttypaste((char *)data, n, IS_SET(MODE_BRCKTPASTE), last);
 		XFree(data);
+		xsel.paste.done += n;
+		xsel.paste.left = xsel.paste.incr ? 0 : rem;
 		/* number of 32-bit chunks returned */
-		ofs += nitems * format / 32;
-	} while (rem > 0);
+		xsel.paste.ofs += nitems * format / 32;
 
-	/*
-	 * Deleting the property again tells the selection owner to send the
-	 * next data chunk in the property.
-	 */
-	XDeleteProperty(xw.dpy, xw.win, (int)property);
+		if (last) {
+			pasteend();
+			break;
+		}
+		if (rem == 0) {
+			/*
+			 * Deleting the property again tells the selection
+			 * owner to send the next data chunk in the property.
+			 */
+			XDeleteProperty(xw.dpy, xw.win, xsel.paste.property);
+			xsel.paste.ofs = 0;
+			xsel.paste.ready = 0;
+		}
+	}
+
+	/* show the progress of pastes which take a while */
+	if (xsel.paste.property == None)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (TIMEDIFF(now, xsel.paste.tshow) < 200)
+		return;
+	if (xsel.paste.left)
+		snprintf(title, sizeof(title), "pasting %lu/%lu KiB",
+		         xsel.paste.done >> 10,
+		         (xsel.paste.done + xsel.paste.left) >> 10);
+	else
+		snprintf(title, sizeof(title), "pasting %lu KiB",
+		         xsel.paste.done >> 10);
+	xsetwmname(title);
+	xsel.paste.shown = 1;
+	xsel.paste.tshow = now;
+}
+
+void
+pasteend(void)
+{
+	if (xsel.paste.incr) {
+		MODBIT(xw.attrs.event_mask, 0, PropertyChangeMask);
+		XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask,
+				&xw.attrs);
+	}
+	XDeleteProperty(xw.dpy, xw.win, xsel.paste.property);
+	xsel.paste.property = None;
+	xsel.paste.ready = 0;
+
+	if (xsel.paste.shown) {
+		xsetwmname(xw.title ? xw.title : opt_title);
+		xsel.paste.shown = 0;
+	}
 }
 
 void
@@ -778,7 +898,8 @@ cresize(int width, int height)
 
 	tresize(col, row);
 	xresize(col, row);
-	ttyresize(win.tw, win.th);
+	win.ttystale = 1;
+	xttyresize();
 }
 
 void
@@ -797,6 +918,29 @@ xresize(int col, int row)
 	xw.specbuf = xrealloc(xw.specbuf, col * sizeof(GlyphFontSpec));
 }
 
+/*
+ * Tells the tty the size of the window, at most once every resizeinterval
+ * ms: programs redraw for each size they are told of. Returns the ms left
+ * until it can be told, if it still has to be, else 0.
+ */
+double
+xttyresize(void)
+{
+	struct timespec now;
+	double left;
+
+	if (!win.ttystale)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((left = resizeinterval - TIMEDIFF(now, win.ttytold)) > 0)
+		return left;
+	ttyresize(win.tw, win.th);
+	win.ttystale = 0;
+	win.ttytold = now;
+
+	return 0;
+}
+
 ushort
 sixd_to_16bit(int x)
 {
@@ -844,6 +988,7 @@ xloadcols(void)
 	static int loaded;
 	Color *cp;
 
+	pthread_mutex_lock(&drawlock);
 	if (!loaded) {
 		dc.collen = 1 + (defaultbg = MAX(LEN(colorname), 256));
 		dc.col = xmalloc(dc.collen * sizeof(Color));
@@ -862,6 +1007,7 @@ xloadcols(void)
 
 	xloadalpha();
 	loaded = 1;
+	pthread_mutex_unlock(&drawlock);
 }
 
 int
@@ -888,8 +1034,10 @@ xsetcolorname(int x, const char *name)
 	if (!xloadcolor(x, name, &ncolor))
 		return 1;
 
+	pthread_mutex_lock(&drawlock);
 	XftColorFree(xw.dpy, xw.vis, xw.cmap, &dc.col[x]);
 	dc.col[x] = ncolor;
+	pthread_mutex_unlock(&drawlock);
 
 	return 0;
 }
@@ -1393,6 +1541,7 @@ xinit(int cols, int rows)
 	xsel.xtarget = XInternAtom(xw.dpy, "UTF8_STRING", 0);
 	if (xsel.xtarget == None)
 		xsel.xtarget = XA_STRING;
+	xsel.incratom = XInternAtom(xw.dpy, "INCR", 0);
 
 	boxdraw_xinit(xw.dpy, xw.cmap, xw.draw, xw.vis);
 }
@@ -1690,10 +1839,11 @@ void
 xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line, int len)
 {
 	Color drawcol;
+	int sel = g.mode & ATTR_SELECTED;
 
 	/* remove the old cursor */
-	if (selected(ox, oy))
-		og.mode ^= ATTR_REVERSE;
+	if (og.mode & ATTR_SELECTED)
+		og.mode ^= ATTR_SELECTED | ATTR_REVERSE;
 
 	/* Redraw the line where cursor was previously.
 	 * It will restore the ligatures broken by the cursor. */
@@ -1710,7 +1860,7 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line, int le
 	if (IS_SET(MODE_REVERSE)) {
 		g.mode |= ATTR_REVERSE;
 		g.bg = defaultfg;
-		if (selected(cx, cy)) {
+		if (sel) {
 			drawcol = dc.col[defaultcs];
 			g.fg = defaultrcs;
 		} else {
@@ -1718,7 +1868,7 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line, int le
 			g.fg = defaultcs;
 		}
 	} else {
-		if (selected(cx, cy)) {
+		if (sel) {
 			g.fg = defaultfg;
 			g.bg = defaultrcs;
 		} else {
@@ -1801,9 +1951,20 @@ xseticontitle(char *p)
 void
 xsettitle(char *p)
 {
-	XTextProperty prop;
 	DEFAULT(p, opt_title);
 
+	free(xw.title);
+	xw.title = xstrdup(p);
+	/* a running paste shows its progress instead */
+	if (!xsel.paste.shown)
+		xsetwmname(p);
+}
+
+void
+xsetwmname(char *p)
+{
+	XTextProperty prop;
+
 	if (Xutf8TextListToTextProperty(xw.dpy, &p, 1, XUTF8StringStyle,
 	                                &prop) != Success)
 		return;
@@ -1815,7 +1976,10 @@ xsettitle(char *p)
 int
 xstartdraw(void)
 {
-	return IS_SET(MODE_VISIBLE);
+	if (!IS_SET(MODE_VISIBLE))
+		return 0;
+	pthread_mutex_lock(&drawlock);
+	return 1;
 }
 
 void
@@ -1831,8 +1995,8 @@ xdrawline(Line line, int x1, int y1, int x2)
 		new = line[x];
 		if (new.mode == ATTR_WDUMMY)
 			continue;
-		if (selected(x, y1))
-			new.mode ^= ATTR_REVERSE;
+		if (new.mode & ATTR_SELECTED)
+			new.mode ^= ATTR_SELECTED | ATTR_REVERSE;
 		if (i > 0 && ATTRCMP(base, new)) {
 			xdrawglyphfontspecs(specs, base, i, ox, y1);
 			specs += i;
@@ -1857,6 +2021,7 @@ xfinishdraw(void)
 	XSetForeground(xw.dpy, dc.gc,
 			dc.col[IS_SET(MODE_REVERSE)?
 				defaultfg : defaultbg].pixel);
+	pthread_mutex_unlock(&drawlock);
 }
 
 void
@@ -1901,10 +2066,14 @@ xsetpointermotion(int set)
 void
 xsetmode(int set, unsigned int flags)
 {
-	int mode = win.mode;
+	int mode;
+
+	pthread_mutex_lock(&drawlock);
+	mode = win.mode;
 	MODBIT(win.mode, set, flags);
+	pthread_mutex_unlock(&drawlock);
 	if ((win.mode & MODE_REVERSE) != (mode & MODE_REVERSE))
-		redraw();
+		tfulldirt();
 }
 
 int
@@ -1912,7 +2081,9 @@ xsetcursor(int cursor)
 {
 	if (!BETWEEN(cursor, 0, 7)) /* 7: st extension */
 		return 1;
+	pthread_mutex_lock(&drawlock);
 	win.cursor = cursor;
+	pthread_mutex_unlock(&drawlock);
 	return 0;
 }
 
@@ -2105,13 +2276,124 @@ cmessage(XEvent *e)
 	}
 }
 
+/*
+ * A window being resized gets a ConfigureNotify for each step of it; only
+ * the last size before a frame is drawn is applied, by run().
+ */
 void
 resize(XEvent *e)
 {
-	if (e->xconfigure.width == win.w && e->xconfigure.height == win.h)
-		return;
+	win.pw = e->xconfigure.width;
+	win.ph = e->xconfigure.height;
+}
+
+/*
+ * On Linux, run() sleeps in epoll_wait(): its deadlines are a timerfd
+ * and SIGCHLD is read from a signalfd instead of handled in signal
+ * context. Elsewhere it falls back to pselect() and a signal handler.
+ */
+void
+loopinit(int xfd)
+{
+#if defined(__linux)
+	sigset_t set;
+	int sigfd;
 
-	cresize(e->xconfigure.width, e->xconfigure.height);
+	/* before fork() and ttythread(), so no thread takes it */
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+	loop.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	sigfd = signalfd(-1, &set, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (loop.epfd < 0 || loop.timerfd < 0 || sigfd < 0)
+		die("event loop setup failed: %s\n", strerror(errno));
+	loopwatch(loop.timerfd, EV_TIMER);
+	loopwatch(sigfd, EV_CHLD);
+#endif
+	loopwatch(xfd, EV_X);
+}
+
+void
+loopwatch(int fd, int ev)
+{
+#if defined(__linux)
+	struct epoll_event e = { .events = EPOLLIN, .data.u32 = ev };
+
+	if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &e) < 0)
+		die("epoll_ctl failed: %s\n", strerror(errno));
+#endif
+	if (loop.n == LEN(loop.fd))
+		die("too many fds to watch\n");
+	loop.fd[loop.n] = fd;
+	loop.ev[loop.n++] = ev;
+}
+
+int
+loopwait(double timeout)
+{
+	char buf[128]; /* a struct signalfd_siginfo */
+	int i, n, ev = 0;
+#if defined(__linux)
+	struct epoll_event e[LEN(loop.fd)];
+	struct itimerspec it = { 0 };
+
+	/* a timeout of 0 polls, and a negative one disarms the timer */
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &it.it_value);
+		it.it_value.tv_sec += timeout / 1E3;
+		it.it_value.tv_nsec += 1E6 * fmod(timeout, 1E3);
+		if (it.it_value.tv_nsec >= 1E9) {
+			it.it_value.tv_sec++;
+			it.it_value.tv_nsec -= 1E9;
+		}
+	}
+	if (timeout > 0 || loop.armed) {
+		timerfd_settime(loop.timerfd, TFD_TIMER_ABSTIME, &it, NULL);
+		loop.armed = timeout > 0;
+	}
+
+	if ((n = epoll_wait(loop.epfd, e, LEN(e), timeout ? -1 : 0)) < 0) {
+		if (errno == EINTR)
+			return 0;
+		die("epoll_wait failed: %s\n", strerror(errno));
+	}
+	for (i = 0; i < n; i++)
+		ev |= e[i].data.u32;
+#else
+	struct timespec seltv;
+	fd_set rfd;
+	int maxfd = 0;
+
+	FD_ZERO(&rfd);
+	for (i = 0; i < loop.n; i++) {
+		FD_SET(loop.fd[i], &rfd);
+		maxfd = MAX(maxfd, loop.fd[i]);
+	}
+	seltv.tv_sec = timeout / 1E3;
+	seltv.tv_nsec = 1E6 * (timeout - 1E3 * seltv.tv_sec);
+
+	if ((n = pselect(maxfd+1, &rfd, NULL, NULL,
+	                 timeout >= 0 ? &seltv : NULL, NULL)) < 0) {
+		if (errno == EINTR)
+			return 0;
+		die("select failed: %s\n", strerror(errno));
+	}
+	for (i = 0; i < loop.n; i++) {
+		if (FD_ISSET(loop.fd[i], &rfd))
+			ev |= loop.ev[i];
+	}
+#endif
+
+	/* consume what woke us up, except for the X connection */
+	for (i = 0; i < loop.n; i++) {
+		if (loop.ev[i] != EV_X && (ev & loop.ev[i]))
+			while (read(loop.fd[i], buf, sizeof(buf)) > 0)
+				;
+	}
+
+	return ev;
 }
 
 void
@@ -2119,10 +2401,9 @@ run(void)
 {
 	XEvent ev;
 	int w = win.w, h = win.h;
-	fd_set rfd;
-	int xfd = XConnectionNumber(xw.dpy), ttyfd, xev, drawing;
-	struct timespec seltv, *tv, now, lastblink, trigger;
-	double timeout;
+	int xev, drawing, evs;
+	struct timespec now, lastblink, trigger;
+	double timeout, left;
 
 	/* Waiting for window mapping */
 	do {
@@ -2140,30 +2421,33 @@ run(void)
 		}
 	} while (ev.type != MapNotify);
 
-	ttyfd = ttynew(opt_line, shell, opt_io, opt_cmd);
+	loopinit(XConnectionNumber(xw.dpy));
+	ttynew(opt_line, shell, opt_io, opt_cmd);
 	cresize(w, h);
 
-	for (timeout = -1, drawing = 0, lastblink = (struct timespec){0};;) {
-		FD_ZERO(&rfd);
-		FD_SET(ttyfd, &rfd);
-		FD_SET(xfd, &rfd);
-
-		if (XPending(xw.dpy))
-			timeout = 0;  /* existing events might not set xfd */
-
-		seltv.tv_sec = timeout / 1E3;
-		seltv.tv_nsec = 1E6 * (timeout - 1E3 * seltv.tv_sec);
-		tv = timeout >= 0 ? &seltv : NULL;
-
-		if (pselect(MAX(xfd, ttyfd)+1, &rfd, NULL, NULL, tv, NULL) < 0) {
-			if (errno == EINTR)
-				continue;
-			die("select failed: %s\n", strerror(errno));
-		}
+	/*
+	 * From now on the tty is read and parsed by another thread, which
+	 * only tells through its fd that it did. Except while waiting and
+	 * while draw() renders, this thread holds termlock.
+	 */
+	tlock();
+	loopwatch(ttythread(), EV_TTY);
+
+	lastblink = trigger = (struct timespec){0};
+	for (timeout = -1, drawing = 0;;) {
+		/* events read along with replies of other requests */
+		if (XEventsQueued(xw.dpy, QueuedAlready))
+			timeout = 0;
+
+		tunlock();
+		evs = loopwait(timeout);
+		tlock();
 		clock_gettime(CLOCK_MONOTONIC, &now);
 
-		if (FD_ISSET(ttyfd, &rfd))
-			ttyread();
+		if (evs & EV_CHLD)
+			sigchld(SIGCHLD);
+		if (evs & EV_TTY)
+			ttyreap();
 
 		xev = 0;
 		while (XPending(xw.dpy)) {
@@ -2174,6 +2458,8 @@ run(void)
 			if (handler[ev.type])
 				(handler[ev.type])(&ev);
 		}
+		/* the tty may have taken some of a paste */
+		pastefill();
 
 		/*
 		 * To reduce flicker and tearing, when new content or event
@@ -2186,7 +2472,7 @@ run(void)
 		 * maximum latency intervals during `cat huge.txt`, and perfect
 		 * sync with periodic updates from animations/key-repeats/etc.
 		 */
-		if (FD_ISSET(ttyfd, &rfd) || xev) {
+		if ((evs & EV_TTY) || xev) {
 			if (!drawing) {
 				trigger = now;
 				drawing = 1;
@@ -2197,6 +2483,13 @@ run(void)
 				continue;  /* we have time, try to find idle */
 		}
 
+		/*
+		 * an application bracketing a frame in a synchronized update
+		 * is drawn once it ends the update, or after synctimeout
+		 */
+		if ((timeout = tinsync(synctimeout)) > 0)
+			continue;
+
 		/* idle detected or maxlatency exhausted -> draw */
 		timeout = -1;
 		if (blinktimeout && tattrset(ATTR_BLINK)) {
@@ -2211,6 +2504,18 @@ run(void)
 			}
 		}
 
+		if (win.pw) {
+			if (win.pw != win.w || win.ph != win.h)
+				cresize(win.pw, win.ph);
+			win.pw = win.ph = 0;
+		}
+		left = xttyresize();
+		if (left > 0 && (timeout < 0 || left < timeout))
+			timeout = left;
+		left = taltfree(alttimeout);
+		if (left > 0 && (timeout < 0 || left < timeout))
+			timeout = left;
+
 		draw();
 		XFlush(xw.dpy);
 		drawing = 0;
@@ -2275,12 +2580,12 @@ usage(void)
 {
 	die("usage: %s [-aiv] [-c class] [-f font] [-g geometry]"
 	    " [-n name] [-o file]\n"
-	    "          [-T title] [-t title] [-w windowid]"
+	    "          [-s lines] [-T title] [-t title] [-w windowid]"
 	    " [[-e] command [args ...]]\n"
 	    "       %s [-aiv] [-c class] [-f font] [-g geometry]"
 	    " [-n name] [-o file]\n"
-	    "          [-T title] [-t title] [-w windowid] -l line"
-	    " [stty_args ...]\n", argv0, argv0);
+	    "          [-s lines] [-T title] [-t title] [-w windowid]"
+	    " -l line [stty_args ...]\n", argv0, argv0);
 }
 
 int
@@ -2323,6 +2628,9 @@ main(int argc, char *argv[])
 	case 'n':
 		opt_name = EARGF(usage());
 		break;
+	case 's':
+		opt_hist = EARGF(usage());
+		break;
 	case 't':
 	case 'T':
 		opt_title = EARGF(usage());
@@ -2347,10 +2655,15 @@ run:
 	setlocale(LC_CTYPE, "");
 	XSetLocaleModifiers("");
 
+	/* the tty thread calls into Xlib too, see ttythread() */
+	if (!XInitThreads())
+		die("Can't initialize Xlib threads\n");
 	if(!(xw.dpy = XOpenDisplay(NULL)))
 		die("Can't open display\n");
 
 	config_init();
+	if (opt_hist)
+		histsize = strtoul(opt_hist, NULL, 10);
 	cols = MAX(cols, 1);
 	rows = MAX(rows, 1);
 	defaultbg = MAX(LEN(colorname), 256);